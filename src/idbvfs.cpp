@@ -24,12 +24,30 @@
  *
  * For more information, please refer to <http://unlicense.org/>
  */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <cerrno>
 #include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 #include <SQLiteVfs.hpp>
@@ -44,6 +62,151 @@
 /// Indexed DB key used to store idbvfs file sizes
 #define IDBVFS_SIZE_KEY "file_size"
 
+/// Indexed DB key used to store the size of database extents
+#define IDBVFS_EXTENT_SIZE_KEY "extent_size"
+
+/// Offset of the first WAL read mark lock in the shared memory locks, see `WAL_READ_LOCK` in SQLite's wal.c
+#define IDBVFS_WAL_READ_LOCK 3
+
+/// Default maximum number of pages cached in memory for each database, shared by all of its connections.
+/// Can be overridden per connection with the "page_cache_size" URI parameter, the largest size asked for is used.
+#ifndef IDBVFS_PAGE_CACHE_SIZE
+	#define IDBVFS_PAGE_CACHE_SIZE 64
+#endif
+
+/// URI parameter used to configure the page cache size
+#define IDBVFS_PAGE_CACHE_SIZE_PARAM "page_cache_size"
+
+/// Number of independently locked parts of the page cache shared by connections to the same database
+#ifndef IDBVFS_PAGE_CACHE_SHARDS
+	#define IDBVFS_PAGE_CACHE_SHARDS 16
+#endif
+
+/// Default number of pages stored in each database extent file, for new databases.
+/// Can be overridden per connection with the "pages_per_extent" URI parameter.
+#ifndef IDBVFS_PAGES_PER_EXTENT
+	#define IDBVFS_PAGES_PER_EXTENT 1
+#endif
+
+/// URI parameter used to configure the number of pages per extent
+#define IDBVFS_PAGES_PER_EXTENT_PARAM "pages_per_extent"
+
+/// Default maximum number of page writes buffered in memory until the next sync.
+/// Can be overridden per connection with the "write_buffer_size" URI parameter.
+/// Use 0 to store pages as soon as they are written.
+#ifndef IDBVFS_WRITE_BUFFER_SIZE
+	#define IDBVFS_WRITE_BUFFER_SIZE 0
+#endif
+
+/// URI parameter used to configure the write buffer size
+#define IDBVFS_WRITE_BUFFER_SIZE_PARAM "write_buffer_size"
+
+/// Size of the objects journals are split into.
+/// Only segments modified since the last sync are stored again.
+#ifndef IDBVFS_JOURNAL_SEGMENT_SIZE
+	#define IDBVFS_JOURNAL_SEGMENT_SIZE 65536
+#endif
+
+/// Number of database writes remembered for keeping the caches of other connections coherent.
+/// Connections that fall further behind than this drop their whole cache.
+#ifndef IDBVFS_CHANGE_LOG_SIZE
+	#define IDBVFS_CHANGE_LOG_SIZE 1024
+#endif
+
+/// Default number of milliseconds a connection waits for a database lock held by another connection in the process,
+/// before returning SQLITE_BUSY to SQLite's busy handler.
+/// Can be overridden per connection with the "lock_timeout" URI parameter.
+#ifndef IDBVFS_LOCK_TIMEOUT
+	#define IDBVFS_LOCK_TIMEOUT 0
+#endif
+
+/// URI parameter used to configure the lock timeout
+#define IDBVFS_LOCK_TIMEOUT_PARAM "lock_timeout"
+
+/// Default maximum number of bytes kept in memory by the caches and buffers of all open files together.
+/// Can be changed at runtime with `idbvfs_memory_limit`. Use 0 for no limit.
+#ifndef IDBVFS_MEMORY_LIMIT
+	#define IDBVFS_MEMORY_LIMIT 0
+#endif
+
+/// Number of bytes of cached pages kept when SQLite and idbvfs together use more than SQLite's soft heap limit.
+/// Caches shrink gradually toward it, one page per page stored, instead of being emptied.
+#ifndef IDBVFS_MEMORY_FLOOR
+	#define IDBVFS_MEMORY_FLOOR 1048576
+#endif
+
+/// Default durability level, one of the `IDBVFS_DURABILITY_*` constants.
+/// Can be overridden per VFS with `idbvfs_set_durability`, and per connection with the "durability" URI parameter.
+#ifndef IDBVFS_DURABILITY
+	#define IDBVFS_DURABILITY IDBVFS_DURABILITY_FULL
+#endif
+
+/// URI parameter used to configure the durability level
+#define IDBVFS_DURABILITY_PARAM "durability"
+
+/// Default maximum number of milliseconds between grouped persistence barriers, in the NORMAL durability level.
+/// Syncs left pending that long are persisted by a timer on the background flusher thread.
+/// Can be overridden per connection with the "group_commit_interval" URI parameter.
+#ifndef IDBVFS_GROUP_COMMIT_INTERVAL
+	#define IDBVFS_GROUP_COMMIT_INTERVAL 1000
+#endif
+
+/// URI parameter used to configure the group commit interval
+#define IDBVFS_GROUP_COMMIT_INTERVAL_PARAM "group_commit_interval"
+
+/// Maximum number of syncs grouped in a single persistence barrier, in the NORMAL durability level
+#ifndef IDBVFS_GROUP_COMMIT_SIZE
+	#define IDBVFS_GROUP_COMMIT_SIZE 100
+#endif
+
+/// Whether syncs leave their persistence barriers to a background thread by default.
+/// Can be overridden per connection with the "async_commit" URI parameter.
+#ifndef IDBVFS_ASYNC_COMMIT
+	#define IDBVFS_ASYNC_COMMIT 0
+#endif
+
+/// URI parameter used to configure asynchronous commits
+#define IDBVFS_ASYNC_COMMIT_PARAM "async_commit"
+
+/// Whether persistence barriers can run on a background thread.
+/// Emscripten builds without pthreads complete them on the calling thread instead.
+#ifndef IDBVFS_BACKGROUND_FLUSH
+	#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+		#define IDBVFS_BACKGROUND_FLUSH 0
+	#else
+		#define IDBVFS_BACKGROUND_FLUSH 1
+	#endif
+#endif
+
+/// Maximum number of files whose existence is remembered by each backend.
+/// The oldest entries are forgotten first, and checked in storage again when probed.
+#ifndef IDBVFS_MAX_KNOWN_FILES
+	#define IDBVFS_MAX_KNOWN_FILES 1024
+#endif
+
+/// Number of deleted databases whose storage is reclaimed together, on the flusher thread.
+/// Storage can also be reclaimed at any time with `idbvfs_reclaim_storage`.
+#ifndef IDBVFS_MAX_PENDING_DELETES
+	#define IDBVFS_MAX_PENDING_DELETES 16
+#endif
+
+/// Maximum number of files kept open for each database directory
+#ifndef IDBVFS_MAX_OPEN_FILES
+	#define IDBVFS_MAX_OPEN_FILES 32
+#endif
+
+/// Size of the header at the start of container files, which keeps the pages after it aligned to file system blocks
+#define IDBVFS_CONTAINER_HEADER_SIZE 4096
+
+/// Bytes of the container header holding each metadata object, including its length byte
+#define IDBVFS_CONTAINER_SLOT_SIZE 64
+
+/// Number of bytes at the start of each container file mapped in memory for reads.
+/// Use 0 to always read with `pread`.
+#ifndef IDBVFS_CONTAINER_MMAP_SIZE
+	#define IDBVFS_CONTAINER_MMAP_SIZE 0
+#endif
+
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
@@ -72,337 +235,4243 @@ static void TRACE_LOG(const char *fmt, ...) {
 
 using namespace sqlitevfs;
 
-class IdbPage {
+/**
+ * Counters reported by `idbvfs_get_stats`, updated by connections on any thread.
+ */
+struct IdbStats {
+	std::atomic<long long> kv_objects_put{0};
+	std::atomic<long long> kv_objects_removed{0};
+	std::atomic<long long> kv_commits{0};
+	std::atomic<long long> journal_bytes_written{0};
+	std::atomic<long long> pages_fetched{0};
+	std::atomic<long long> objects_read{0};
+	std::atomic<long long> existence_checks{0};
+	std::atomic<long long> objects_written{0};
+};
+
+static IdbStats idbvfs_global_stats;
+
+/// Serializes access to storages and backends, which are shared by connections on any thread
+static std::recursive_mutex idbvfs_storage_mutex;
+typedef std::lock_guard<std::recursive_mutex> IdbStorageGuard;
+
+/**
+ * Memory held by the caches and buffers of all open files.
+ *
+ * The budget is exceeded when idbvfs uses more than its own limit. Memory used
+ * by SQLite itself only puts caches under pressure, when SQLite and idbvfs
+ * together use more than SQLite's soft heap limit.
+ */
+class IdbMemoryBudget {
 public:
-	IdbPage() {}
+	void update(size_t old_bytes, size_t new_bytes) {
+		used_bytes += (long long) new_bytes - (long long) old_bytes;
+	}
 
-	IdbPage(const char *dbname, const char *subfilename)
-		: dbname(dbname)
-		, filename(dbname)
-	{
-		filename.append("/");
-		filename.append(subfilename);
+	bool exceeded() const {
+		long long limit = limit_bytes;
+		return limit > 0 && used_bytes > limit;
 	}
 
-	IdbPage(const char *dbname, int page_number)
-		: IdbPage(dbname, std::to_string(page_number).c_str())
-	{
+	/**
+	 * Whether caches should shrink, because SQLite and idbvfs together use more than SQLite's soft heap limit
+	 * while idbvfs uses more than `IDBVFS_MEMORY_FLOOR`.
+	 */
+	bool under_pressure() const {
+		long long used = used_bytes;
+		if (used <= IDBVFS_MEMORY_FLOOR) {
+			return false;
+		}
+		sqlite3_int64 soft_heap_limit = sqlite3_soft_heap_limit64(-1);
+		return soft_heap_limit > 0 && sqlite3_memory_used() + used > soft_heap_limit;
 	}
 
-	bool exists() const {
-		if (FILE *f = fopen(filename.c_str(), "r")) {
-			fclose(f);
-			return true;
+	long long get_used() const {
+		return used_bytes;
+	}
+
+	long long get_limit() const {
+		return limit_bytes;
+	}
+
+	void set_limit(long long limit) {
+		limit_bytes = limit;
+	}
+
+	void count_eviction() {
+		evicted_pages++;
+	}
+
+	long long get_evicted_pages() const {
+		return evicted_pages;
+	}
+
+private:
+	std::atomic<long long> used_bytes{0};
+	std::atomic<long long> limit_bytes{IDBVFS_MEMORY_LIMIT};
+	std::atomic<long long> evicted_pages{0};
+};
+
+static IdbMemoryBudget idbvfs_memory;
+
+/**
+ * Byte buffer whose memory is drawn from the idbvfs memory budget.
+ */
+class IdbBuffer {
+public:
+	IdbBuffer() {}
+
+	IdbBuffer(const IdbBuffer& other) {
+		assign(other.data(), other.size());
+	}
+
+	~IdbBuffer() {
+		clear();
+	}
+
+	IdbBuffer& operator=(const IdbBuffer& other) {
+		if (this != &other) {
+			assign(other.data(), other.size());
 		}
-		else {
+		return *this;
+	}
+
+	uint8_t *data() {
+		return bytes.data();
+	}
+
+	const uint8_t *data() const {
+		return bytes.data();
+	}
+
+	size_t size() const {
+		return bytes.size();
+	}
+
+	bool empty() const {
+		return bytes.empty();
+	}
+
+	void assign(const void *data, size_t data_size) {
+		const uint8_t *data_bytes = (const uint8_t *) data;
+		bytes.assign(data_bytes, data_bytes + data_size);
+		update_budget();
+	}
+
+	void resize(size_t size) {
+		bytes.resize(size);
+		update_budget();
+	}
+
+	/**
+	 * Empty the buffer, freeing its memory.
+	 */
+	void clear() {
+		std::vector<uint8_t>().swap(bytes);
+		update_budget();
+	}
+
+	void swap(IdbBuffer& other) {
+		bytes.swap(other.bytes);
+		std::swap(budgeted_bytes, other.budgeted_bytes);
+	}
+
+private:
+	std::vector<uint8_t> bytes;
+	size_t budgeted_bytes = 0;
+
+	void update_budget() {
+		idbvfs_memory.update(budgeted_bytes, bytes.capacity());
+		budgeted_bytes = bytes.capacity();
+	}
+};
+
+/**
+ * Byte ranges written to a database file by all connections in the process.
+ *
+ * Every write increments the generation number. Connections remember the
+ * generation their caches reflect, and when starting a read transaction
+ * invalidate only the ranges written since then by other connections.
+ */
+class IdbChangeLog {
+public:
+	uint64_t generation() const {
+		return current_generation;
+	}
+
+	/**
+	 * Record a write to the [`offset`, `offset + size`) range.
+	 *
+	 * @return The new generation number.
+	 */
+	uint64_t record(sqlite3_int64 offset, sqlite3_int64 size) {
+		if (changes.size() >= IDBVFS_CHANGE_LOG_SIZE) {
+			changes.pop_front();
+		}
+		changes.push_back(Change { ++current_generation, offset, size });
+		return current_generation;
+	}
+
+	/**
+	 * Call `f(offset, size)` for each range written after generation `since`.
+	 *
+	 * @return Whether all of those writes were still recorded.
+	 */
+	template<typename Function>
+	bool changes_since(uint64_t since, Function f) const {
+		if (since < current_generation - changes.size()) {
+			return false;
+		}
+		for (auto it = changes.end() - (current_generation - since); it != changes.end(); ++it) {
+			f(it->offset, it->size);
+		}
+		return true;
+	}
+
+private:
+	struct Change {
+		uint64_t generation;
+		sqlite3_int64 offset;
+		sqlite3_int64 size;
+	};
+	std::deque<Change> changes;
+	uint64_t current_generation = 0;
+};
+
+/**
+ * Persistence barriers grouped over several syncs, for the NORMAL durability level.
+ */
+class IdbGroupCommit {
+public:
+	/**
+	 * Count a sync, returning whether enough syncs or `interval` went by since the last barrier to make another one.
+	 * Pending syncs are due after the interval of the connection that synced last.
+	 */
+	bool sync_is_due(std::chrono::milliseconds interval) {
+		defer();
+		this->interval = interval;
+		return pending_syncs >= IDBVFS_GROUP_COMMIT_SIZE
+			|| std::chrono::steady_clock::now() - last_barrier >= interval;
+	}
+
+	/**
+	 * Count a sync whose barrier is left for later.
+	 */
+	void defer() {
+		pending_syncs++;
+	}
+
+	bool pending() const {
+		return pending_syncs > 0;
+	}
+
+	void barrier_done() {
+		pending_syncs = 0;
+		last_barrier = std::chrono::steady_clock::now();
+	}
+
+	/**
+	 * Time left until pending syncs are due for a barrier, even if no more syncs come.
+	 */
+	std::chrono::milliseconds time_until_due() const {
+		auto elapsed = std::chrono::steady_clock::now() - last_barrier;
+		return std::max(std::chrono::milliseconds(0), interval - std::chrono::duration_cast<std::chrono::milliseconds>(elapsed));
+	}
+
+private:
+	int pending_syncs = 0;
+	std::chrono::milliseconds interval{IDBVFS_GROUP_COMMIT_INTERVAL};
+	std::chrono::steady_clock::time_point last_barrier = std::chrono::steady_clock::now();
+};
+
+/**
+ * Work left to complete a persistence barrier, which runs without holding the storage mutex,
+ * possibly on the background flusher thread.
+ */
+class IdbFlushTask {
+public:
+	virtual ~IdbFlushTask() {}
+
+	virtual bool run() = 0;
+};
+
+/**
+ * Barrier that was already completed when it was started.
+ */
+class IdbCompletedFlush : public IdbFlushTask {
+public:
+	IdbCompletedFlush(bool success) : success(success) {}
+
+	bool run() override {
+		return success;
+	}
+
+private:
+	bool success;
+};
+
+class IdbStorage;
+class IdbBackend;
+
+/// Storages whose grouped syncs wait for the flusher's timer, guarded by the storage mutex
+static std::set<IdbStorage *> idbvfs_group_commits;
+
+/// Backends whose deleted databases wait for the flusher to reclaim them, guarded by the storage mutex
+static std::set<IdbBackend *> idbvfs_pending_reclaims;
+
+/**
+ * Background thread that completes persistence barriers of asynchronous commits,
+ * in the order they were started.
+ *
+ * Barriers are numbered, so that callers can wait for all barriers started
+ * up to some point. Failed barriers are counted until someone waits for them.
+ *
+ * The thread also runs a timer, which starts the barriers of grouped syncs
+ * that no later sync came to complete.
+ */
+class IdbFlusher {
+public:
+	~IdbFlusher() {
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			stopping = true;
+		}
+		queued.notify_all();
+		// pending barriers are completed before the process exits
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	/**
+	 * Queue the rest of a barrier.
+	 *
+	 * @return Number of the barrier.
+	 */
+	uint64_t enqueue(std::unique_ptr<IdbFlushTask> task) {
+		std::unique_lock<std::mutex> lock(mutex);
+		uint64_t sequence = ++started;
+		if (!IDBVFS_BACKGROUND_FLUSH || stopping) {
+			lock.unlock();
+			bool success = task->run();
+			lock.lock();
+			finish(success);
+			return sequence;
+		}
+		tasks.push_back(std::move(task));
+		if (!thread.joinable()) {
+			thread = std::thread(&IdbFlusher::run, this);
+		}
+		queued.notify_one();
+		return sequence;
+	}
+
+	/**
+	 * Number of the last barrier started.
+	 */
+	uint64_t last_started() {
+		std::lock_guard<std::mutex> guard(mutex);
+		return started;
+	}
+
+	/**
+	 * Wait until barrier number `sequence` and all barriers before it are complete.
+	 *
+	 * @param timeout_ms  Maximum milliseconds to wait, or a negative value to wait as long as needed.
+	 * @return `SQLITE_OK`, `SQLITE_BUSY` if the wait timed out, or `SQLITE_IOERR_FSYNC` if barriers failed since the last wait.
+	 */
+	int wait(uint64_t sequence, int timeout_ms) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto is_complete = [&] { return completed >= sequence; };
+		if (timeout_ms < 0) {
+			finished.wait(lock, is_complete);
+		}
+		else if (!finished.wait_for(lock, std::chrono::milliseconds(timeout_ms), is_complete)) {
+			return SQLITE_BUSY;
+		}
+		if (failures > 0) {
+			failures = 0;
+			return SQLITE_IOERR_FSYNC;
+		}
+		return SQLITE_OK;
+	}
+
+	long long get_completed() {
+		std::lock_guard<std::mutex> guard(mutex);
+		return background_completed;
+	}
+
+	/**
+	 * Call `callback` once `delay` went by, or earlier if it was already scheduled for an earlier time.
+	 * The callback runs on the flusher thread, or on the Emscripten event loop without pthreads.
+	 */
+	void schedule(std::chrono::milliseconds delay, void (*callback)()) {
+		std::unique_lock<std::mutex> lock(mutex);
+		auto deadline = std::chrono::steady_clock::now() + delay;
+		auto it = timers.find(callback);
+		if (it != timers.end() && it->second <= deadline) {
+			return;
+		}
+		timers[callback] = deadline;
+#if IDBVFS_BACKGROUND_FLUSH
+		if (!stopping && !thread.joinable()) {
+			thread = std::thread(&IdbFlusher::run, this);
+		}
+		queued.notify_one();
+#elif defined(__EMSCRIPTEN__)
+		emscripten_async_call(run_timer, this, delay.count());
+#endif
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable queued;
+	std::condition_variable finished;
+	std::deque<std::unique_ptr<IdbFlushTask>> tasks;
+	std::thread thread;
+	std::map<void (*)(), std::chrono::steady_clock::time_point> timers;
+	uint64_t started = 0;
+	uint64_t completed = 0;
+	long long background_completed = 0;
+	int failures = 0;
+	bool stopping = false;
+
+#if !IDBVFS_BACKGROUND_FLUSH && defined(__EMSCRIPTEN__)
+	static void run_timer(void *arg) {
+		IdbFlusher *flusher = (IdbFlusher *) arg;
+		std::unique_lock<std::mutex> lock(flusher->mutex);
+		// callbacks whose schedule was moved to a later time are left to that schedule
+		flusher->run_due_timers(lock);
+	}
+#endif
+
+	std::chrono::steady_clock::time_point next_deadline() const {
+		auto deadline = std::chrono::steady_clock::time_point::max();
+		for (auto& it : timers) {
+			deadline = std::min(deadline, it.second);
+		}
+		return deadline;
+	}
+
+	/**
+	 * Run the callbacks whose deadline went by, without holding the flusher's mutex.
+	 */
+	void run_due_timers(std::unique_lock<std::mutex>& lock) {
+		std::vector<void (*)()> callbacks;
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = timers.begin(); it != timers.end(); ) {
+			if (it->second <= now) {
+				callbacks.push_back(it->first);
+				it = timers.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		lock.unlock();
+		for (void (*callback)() : callbacks) {
+			callback();
+		}
+		lock.lock();
+	}
+
+	void finish(bool success) {
+		completed++;
+		if (!success) {
+			failures++;
+		}
+		finished.notify_all();
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			auto has_work = [&] { return stopping || !tasks.empty(); };
+			// schedules made while waiting wake the thread, to wait for their deadline instead
+			if (!timers.empty()) {
+				auto deadline = next_deadline();
+				queued.wait_until(lock, deadline, [&] { return has_work() || next_deadline() != deadline; });
+			}
+			else {
+				queued.wait(lock, [&] { return has_work() || !timers.empty(); });
+			}
+			if (tasks.empty()) {
+				if (stopping) {
+					return;
+				}
+				run_due_timers(lock);
+				continue;
+			}
+			std::unique_ptr<IdbFlushTask> task = std::move(tasks.front());
+			tasks.pop_front();
+			lock.unlock();
+			bool success = task->run();
+			task.reset();
+			lock.lock();
+			background_completed++;
+			finish(success);
+		}
+	}
+};
+
+static IdbFlusher idbvfs_flusher;
+
+/**
+ * Size of a file in memory, and whether it changed since it was stored.
+ */
+struct IdbFileSizeState {
+	size_t size = 0;
+	bool is_dirty = false;
+
+	/// Number of connections sharing the size, which is loaded when the first one opens the file
+	int users = 0;
+};
+
+/**
+ * Storage for the objects of a single database.
+ *
+ * Objects are blobs identified by a key, like the files inside a directory
+ * or the objects inside an IndexedDB object store. Storages are shared by
+ * all users of the same database name in the process, see `IdbBackend`.
+ */
+class IdbStorage {
+public:
+	virtual ~IdbStorage() {
+		// storages used to reclaim deleted databases are destroyed on the flusher thread
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		idbvfs_group_commits.erase(this);
+	}
+
+	/**
+	 * Read up to `data_size` bytes at `offset` of the object named `key`.
+	 *
+	 * @return Number of bytes read, 0 if the object does not exist.
+	 */
+	virtual int get(const char *key, void *data, size_t data_size, sqlite3_int64 offset) = 0;
+
+	/**
+	 * Write `data_size` bytes at `offset` of the object named `key`, creating it if necessary.
+	 *
+	 * @param replace  If true, the written data replaces the whole object contents.
+	 * @return Number of bytes written.
+	 */
+	virtual int put(const char *key, const void *data, size_t data_size, sqlite3_int64 offset, bool replace) = 0;
+
+	/**
+	 * Shrink the object named `key` to `size` bytes, if it is bigger than that.
+	 */
+	virtual bool truncate(const char *key, sqlite3_int64 size) = 0;
+
+	virtual bool exists(const char *key) = 0;
+
+	virtual bool remove(const char *key) = 0;
+
+	/**
+	 * List the keys of all stored objects.
+	 */
+	virtual std::vector<std::string> list() = 0;
+
+	/**
+	 * Persistence barrier: make all previous writes durable.
+	 *
+	 * @param sync_flags  Flags SQLite passed to `xSync`. With `SQLITE_SYNC_DATAONLY`,
+	 *                    metadata that is not needed to read the data back may be left unsynced.
+	 */
+	virtual bool flush(int sync_flags) = 0;
+
+	/**
+	 * Start a persistence barrier for all previous writes, returning the work left to complete it.
+	 * Storages whose barriers are quick to make complete them right away.
+	 */
+	virtual std::unique_ptr<IdbFlushTask> begin_flush(int sync_flags) {
+		return std::unique_ptr<IdbFlushTask>(new IdbCompletedFlush(flush(sync_flags)));
+	}
+
+	/**
+	 * Whether `flush` persists all writes made since the previous flush at once, or none of them.
+	 * Atomic flushes persist the writes of all storages of the same backend.
+	 */
+	virtual bool atomic_flush() const = 0;
+
+	/// Writes made to the database file by all connections sharing this storage
+	IdbChangeLog change_log;
+
+	/// Syncs waiting for a grouped persistence barrier
+	IdbGroupCommit group_commit;
+
+	/// Number of the last barrier of this storage left to the background flusher
+	uint64_t pending_barrier = 0;
+
+	/// Size of the file, for files all connections append to, like WAL files
+	IdbFileSizeState shared_size;
+};
+
+/**
+ * Work left to reclaim the storage of deleted databases, which runs without holding the storage mutex.
+ */
+class IdbReclaimTask {
+public:
+	virtual ~IdbReclaimTask() {}
+
+	/**
+	 * @return Number of removed objects.
+	 */
+	virtual int run() = 0;
+};
+
+/**
+ * Reclaim that was already completed when it was started.
+ */
+class IdbCompletedReclaim : public IdbReclaimTask {
+public:
+	IdbCompletedReclaim(int removed_objects) : removed_objects(removed_objects) {}
+
+	int run() override {
+		return removed_objects;
+	}
+
+private:
+	int removed_objects;
+};
+
+/**
+ * Start the barriers of grouped syncs that are due, since no later sync came to do it.
+ * Called by the flusher's timer, so that syncs in the NORMAL durability level are persisted
+ * within their group commit interval.
+ */
+static void flush_group_commits() {
+	IdbStorageGuard guard(idbvfs_storage_mutex);
+	std::chrono::milliseconds next_due(IDBVFS_GROUP_COMMIT_INTERVAL);
+	for (auto it = idbvfs_group_commits.begin(); it != idbvfs_group_commits.end(); ) {
+		IdbStorage *storage = *it;
+		std::chrono::milliseconds time_until_due = storage->group_commit.time_until_due();
+		if (storage->group_commit.pending() && time_until_due.count() > 0) {
+			next_due = std::min(next_due, time_until_due);
+			++it;
+			continue;
+		}
+		if (storage->group_commit.pending()) {
+			storage->group_commit.barrier_done();
+			storage->pending_barrier = idbvfs_flusher.enqueue(storage->begin_flush(SQLITE_SYNC_NORMAL));
+		}
+		it = idbvfs_group_commits.erase(it);
+	}
+	if (!idbvfs_group_commits.empty()) {
+		idbvfs_flusher.schedule(next_due, flush_group_commits);
+	}
+}
+
+/**
+ * Known existence of files, so that repeated `xAccess` probes are answered from memory.
+ *
+ * SQLite probes for a hot journal at the start of every read transaction,
+ * which almost always does not exist. Files not known yet are checked in the
+ * backend once, and are kept up to date as they are stored and deleted.
+ * At most `IDBVFS_MAX_KNOWN_FILES` files are remembered, forgetting the oldest first.
+ */
+class IdbExistenceCache {
+public:
+	/**
+	 * @return Whether the existence of file `name` is known, filling `exists` if so.
+	 */
+	bool lookup(const char *name, bool& exists) const {
+		auto it = files.find(name);
+		if (it == files.end()) {
 			return false;
 		}
+		exists = it->second;
+		return true;
+	}
+
+	void set(const char *name, bool exists) {
+		auto result = files.emplace(name, exists);
+		if (!result.second) {
+			result.first->second = exists;
+			return;
+		}
+		insertion_order.push_back(name);
+		if (insertion_order.size() > IDBVFS_MAX_KNOWN_FILES) {
+			files.erase(insertion_order.front());
+			insertion_order.pop_front();
+		}
+	}
+
+private:
+	std::unordered_map<std::string, bool> files;
+	std::deque<std::string> insertion_order;
+};
+
+/**
+ * Provider of the storages used by idbvfs.
+ */
+class IdbBackend {
+public:
+	virtual ~IdbBackend() {}
+
+	/// Existence of files stored by this backend, shared by all VFSs using it
+	IdbExistenceCache known_files;
+
+	/// Number of databases synced by the commit running on each thread, which share the barrier made when the last one ends
+	std::map<std::thread::id, int> committing_databases;
+
+	/**
+	 * Get the storage for database `dbname`.
+	 * Every acquired storage must be released with `release`.
+	 */
+	virtual IdbStorage *acquire(const char *dbname) = 0;
+
+	virtual void release(IdbStorage *storage) = 0;
+
+	/**
+	 * Whether storages can be acquired.
+	 * Backends that load their contents asynchronously are not ready until the load completes.
+	 */
+	virtual bool ready() {
+		return true;
+	}
+
+	/**
+	 * Delete database `dbname` in constant time, except for directories on Emscripten which are removed right away.
+	 * Its objects are detached from the name right away, so the name can be reused,
+	 * but storage is only reclaimed later by `begin_reclaim`.
+	 *
+	 * Databases that were never stored, like journals of transactions that
+	 * were not synced, are successfully deleted as well.
+	 *
+	 * @return Whether the operation succeeded.
+	 */
+	virtual bool remove_database(const char *dbname) = 0;
+
+	/**
+	 * Make the removal of database `dbname` durable, for deletions that SQLite asks to sync.
+	 */
+	virtual bool sync_removal(const char *dbname) {
+		return true;
+	}
+
+	/**
+	 * Number of deleted databases waiting to be reclaimed.
+	 */
+	virtual int pending_reclaims() const = 0;
+
+	/**
+	 * Start reclaiming storage of all deleted databases in bulk.
+	 * Backends whose deleted objects are quick to free complete it right away.
+	 */
+	virtual std::unique_ptr<IdbReclaimTask> begin_reclaim() = 0;
+};
+
+/**
+ * Reclaim the deleted databases of backends that have enough of them waiting, in bulk.
+ * Scheduled on the flusher by deletions, so that these keep taking constant time.
+ */
+static void reclaim_deleted_databases() {
+	std::vector<std::unique_ptr<IdbReclaimTask>> tasks;
+	{
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		for (IdbBackend *backend : idbvfs_pending_reclaims) {
+			tasks.push_back(backend->begin_reclaim());
+		}
+		idbvfs_pending_reclaims.clear();
+	}
+	for (std::unique_ptr<IdbReclaimTask>& task : tasks) {
+		task->run();
+	}
+}
+
+/**
+ * Open the directory containing `path`, so that its entry for `path` can be synced.
+ */
+static int open_parent_dir(const std::string& path) {
+	size_t separator = path.rfind('/');
+	std::string parent = separator == std::string::npos ? "." : separator == 0 ? "/" : path.substr(0, separator);
+	return open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Make the data of a file durable.
+ */
+static bool sync_file(int fd, int sync_flags) {
+#if defined(__APPLE__) && defined(F_FULLFSYNC)
+	if (sync_flags & SQLITE_SYNC_FULL) {
+		return fcntl(fd, F_FULLFSYNC, 0) == 0;
+	}
+	return fsync(fd) == 0;
+#else
+	// like SQLite's unix VFS, fdatasync is enough: it still syncs the file length, and idbvfs does not use other metadata
+	return fdatasync(fd) == 0;
+#endif
+}
+
+/**
+ * Barrier that syncs the files written since the previous one as a batch, then their directories.
+ *
+ * Files are written before the barrier starts, so the kernel may persist them in any order, sizes included.
+ * Owns the file descriptors it syncs, which are invalid (-1) if they could not be opened.
+ */
+class IdbFileSyncTask : public IdbFlushTask {
+public:
+	IdbFileSyncTask(int sync_flags) : sync_flags(sync_flags) {}
+
+	~IdbFileSyncTask() {
+		for (const std::vector<int> *fds : { &file_fds, &directory_fds }) {
+			for (int fd : *fds) {
+				if (fd >= 0) {
+					close(fd);
+				}
+			}
+		}
+	}
+
+	void add_file(int fd) {
+		file_fds.push_back(fd);
+	}
+
+	void add_directory(int fd) {
+		directory_fds.push_back(fd);
+	}
+
+	bool run() override {
+		bool success = sync_files(file_fds);
+		// directory entries of created and removed files are synced once, after the files themselves
+		for (int fd : directory_fds) {
+			success = fd >= 0 && fsync(fd) == 0 && success;
+		}
+		return success;
+	}
+
+private:
+	std::vector<int> file_fds;
+	std::vector<int> directory_fds;
+	int sync_flags;
+
+	bool sync_files(const std::vector<int>& fds) const {
+#ifdef SYNC_FILE_RANGE_WRITE
+		// start writeback of every file before waiting for any, so that the device gets them all at once
+		for (int fd : fds) {
+			if (fd >= 0) {
+				sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+			}
+		}
+#endif
+		bool success = true;
+		for (int fd : fds) {
+			success = fd >= 0 && sync_file(fd, sync_flags) && success;
+		}
+		return success;
+	}
+
+};
+
+/**
+ * Storage that keeps objects as files inside a directory, one directory per database.
+ *
+ * On Emscripten, directories are inside an IDBFS mount, so files are persisted
+ * to Indexed DB when flushed. The directory itself is kept open, so that files
+ * are opened with `openat` without resolving the whole path, plus a bounded LRU
+ * pool of open file descriptors which are read and written with `pread`/`pwrite`.
+ */
+class IdbDirectoryStorage : public IdbStorage {
+public:
+	IdbDirectoryStorage(const char *path) : path(path) {}
+
+	~IdbDirectoryStorage() {
+		close_all();
+	}
+
+	int get(const char *key, void *data, size_t data_size, sqlite3_int64 offset) override {
+		int fd = open_file(key, false);
+		if (fd < 0) {
+			return 0;
+		}
+		size_t read_bytes = 0;
+		while (read_bytes < data_size) {
+			ssize_t result = pread(fd, (uint8_t *) data + read_bytes, data_size - read_bytes, offset + read_bytes);
+			if (result <= 0) {
+				break;
+			}
+			read_bytes += result;
+		}
+		return read_bytes;
+	}
+
+	int put(const char *key, const void *data, size_t data_size, sqlite3_int64 offset, bool replace) override {
+		off_t file_size;
+		int fd = open_file(key, true, &file_size);
+		if (fd < 0) {
+			return 0;
+		}
+		open_files.front().dirty = true;
+		size_t written_bytes = 0;
+		while (written_bytes < data_size) {
+			ssize_t result = pwrite(fd, (const uint8_t *) data + written_bytes, data_size - written_bytes, offset + written_bytes);
+			if (result <= 0) {
+				break;
+			}
+			written_bytes += result;
+		}
+		off_t end = offset + written_bytes;
+		if (replace && file_size > end) {
+			if (ftruncate(fd, end) != 0) {
+				return 0;
+			}
+			set_file_size(key, end);
+		}
+		else if (end > file_size) {
+			set_file_size(key, end);
+		}
+		return written_bytes;
+	}
+
+	bool truncate(const char *key, sqlite3_int64 size) override {
+		off_t file_size;
+		int fd = open_file(key, false, &file_size);
+		if (fd < 0) {
+			return false;
+		}
+		if (file_size > size) {
+			open_files.front().dirty = true;
+			if (ftruncate(fd, size) != 0) {
+				return false;
+			}
+			set_file_size(key, size);
+		}
+		return true;
+	}
+
+	bool exists(const char *key) override {
+		if (open_files_index.find(key) != open_files_index.end()) {
+			return true;
+		}
+		int dirfd = open_dir(false);
+		return dirfd >= 0 && faccessat(dirfd, key, F_OK, 0) == 0;
+	}
+
+	bool remove(const char *key) override {
+		auto it = open_files_index.find(key);
+		if (it != open_files_index.end()) {
+			close_file(it->second);
+		}
+		dirty_closed_files.erase(key);
+		directory_dirty = true;
+		int dirfd = open_dir(false);
+		return dirfd >= 0 && unlinkat(dirfd, key, 0) == 0;
+	}
+
+	std::vector<std::string> list() override {
+		std::vector<std::string> keys;
+		if (DIR *dir = opendir(path.c_str())) {
+			while (struct dirent *entry = readdir(dir)) {
+				if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+					keys.push_back(entry->d_name);
+				}
+			}
+			closedir(dir);
+		}
+		return keys;
+	}
+
+	bool flush(int sync_flags) override {
+#ifdef __EMSCRIPTEN__
+		INLINE_JS({
+			Module.idbvfsSyncfs();
+		});
+		return true;
+#else
+		return begin_flush(sync_flags)->run();
+#endif
+	}
+
+#ifndef __EMSCRIPTEN__
+	std::unique_ptr<IdbFlushTask> begin_flush(int sync_flags) override {
+		// descriptors are duplicated, so that files may be closed by the pool while they are synced
+		IdbFileSyncTask *task = new IdbFileSyncTask(sync_flags);
+		for (OpenFile& file : open_files) {
+			if (file.dirty) {
+				task->add_file(dup(file.fd));
+				file.dirty = false;
+			}
+		}
+		int dirfd = open_dir(false);
+		for (const std::string& name : dirty_closed_files) {
+			int fd = dirfd >= 0 ? openat(dirfd, name.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+			// files removed since they were written have nothing left to sync
+			if (fd >= 0 || (errno != ENOENT && dirfd >= 0)) {
+				task->add_file(fd);
+			}
+		}
+		dirty_closed_files.clear();
+		// created and removed files must be synced with their directory, and a created directory with its parent
+		if (directory_dirty && dirfd >= 0) {
+			task->add_directory(dup(dirfd));
+			directory_dirty = false;
+		}
+		if (directory_created) {
+			task->add_directory(open_parent_dir(path));
+			directory_created = false;
+		}
+		return std::unique_ptr<IdbFlushTask>(task);
+	}
+#endif
+
+	bool atomic_flush() const override {
+#ifdef __EMSCRIPTEN__
+		// IDBFS persists all changed files in a single IndexedDB transaction
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	const std::string& get_path() const {
+		return path;
+	}
+
+	void close_all() {
+		while (!open_files.empty()) {
+			close_file(open_files.begin());
+		}
+		if (dirfd >= 0) {
+			close(dirfd);
+			dirfd = -1;
+		}
+	}
+
+	int refcount = 0;
+
+private:
+	struct OpenFile {
+		std::string name;
+		int fd;
+		off_t size;
+		/// Whether the file was written since the last flush
+		bool dirty = false;
+	};
+
+	std::string path;
+	int dirfd = -1;
+	std::list<OpenFile> open_files;
+	std::unordered_map<std::string, std::list<OpenFile>::iterator> open_files_index;
+	/// Files written since the last flush that were closed to keep the pool bounded
+	std::set<std::string> dirty_closed_files;
+	/// Whether files were created or removed since the last flush
+	bool directory_dirty = false;
+	/// Whether the directory was created since the last flush
+	bool directory_created = false;
+
+	int open_dir(bool create) {
+		if (dirfd < 0) {
+			dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dirfd < 0 && create && mkdir(path.c_str(), 0777) == 0) {
+				dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				directory_created = true;
+			}
+		}
+		return dirfd;
+	}
+
+	/**
+	 * Get an open file descriptor for the file named `key`, which is owned by the pool.
+	 *
+	 * @return File descriptor or -1 if the file does not exist and `create` is false.
+	 */
+	int open_file(const char *key, bool create, off_t *out_file_size = nullptr) {
+		auto it = open_files_index.find(key);
+		if (it != open_files_index.end()) {
+			open_files.splice(open_files.begin(), open_files, it->second);
+		}
+		else {
+			int dirfd = open_dir(create);
+			if (dirfd < 0) {
+				return -1;
+			}
+			int fd = openat(dirfd, key, O_RDWR | O_CLOEXEC, 0666);
+			if (fd < 0 && create && errno == ENOENT) {
+				fd = openat(dirfd, key, O_RDWR | O_CLOEXEC | O_CREAT, 0666);
+				directory_dirty = true;
+			}
+			if (fd < 0) {
+				return -1;
+			}
+			struct stat st;
+			if (fstat(fd, &st) != 0) {
+				close(fd);
+				return -1;
+			}
+
+			if (open_files.size() >= IDBVFS_MAX_OPEN_FILES) {
+				close_file(std::prev(open_files.end()));
+			}
+			open_files.emplace_front();
+			OpenFile& file = open_files.front();
+			file.name = key;
+			file.fd = fd;
+			file.size = st.st_size;
+			open_files_index[file.name] = open_files.begin();
+		}
+
+		if (out_file_size) {
+			*out_file_size = open_files.front().size;
+		}
+		return open_files.front().fd;
+	}
+
+	void set_file_size(const char *key, off_t file_size) {
+		auto it = open_files_index.find(key);
+		if (it != open_files_index.end()) {
+			it->second->size = file_size;
+		}
+	}
+
+	void close_file(std::list<OpenFile>::iterator it) {
+		if (it->dirty) {
+			dirty_closed_files.insert(it->name);
+		}
+		close(it->fd);
+		open_files_index.erase(it->name);
+		open_files.erase(it);
+	}
+};
+
+/**
+ * Backend that stores each database in a directory named after it.
+ * Directories are closed when they are not used anymore.
+ *
+ * Natively, deleted databases have their directory renamed to "<name>-deleted-<N>",
+ * which is emptied and removed in bulk on `begin_reclaim`. Directories left behind
+ * by previous processes are found by scanning the parent directories of known
+ * databases when reclaiming, so names ending in "-deleted-<N>" are reserved.
+ *
+ * On Emscripten, deleted directories are removed right away: IDBFS persists every
+ * path it finds, so a renamed directory would be uploaded to Indexed DB again.
+ */
+class IdbDirectoryBackend : public IdbBackend {
+public:
+	IdbStorage *acquire(const char *dbname) override {
+		auto it = directories.find(dbname);
+		if (it == directories.end()) {
+			it = directories.emplace(dbname, new IdbDirectoryStorage(dbname)).first;
+			parent_directories.insert(parent_path(dbname));
+		}
+		it->second->refcount++;
+		return it->second;
+	}
+
+	void release(IdbStorage *storage) override {
+		IdbDirectoryStorage *directory = static_cast<IdbDirectoryStorage *>(storage);
+		if (directory && --directory->refcount == 0) {
+			directories.erase(directory->get_path());
+			delete directory;
+		}
+	}
+
+	bool remove_database(const char *dbname) override {
+		auto it = directories.find(dbname);
+		if (it != directories.end()) {
+			it->second->close_all();
+		}
+
+#ifdef __EMSCRIPTEN__
+		remove_directory(dbname);
+		return rmdir(dbname) == 0 || errno == ENOENT;
+#else
+		parent_directories.insert(parent_path(dbname));
+		while (true) {
+			std::string deleted_path = std::string(dbname) + "-deleted-" + std::to_string(deleted_count++);
+			if (rename(dbname, deleted_path.c_str()) == 0) {
+				deleted_directories.insert(deleted_path);
+				return true;
+			}
+			else if (errno == EEXIST || errno == ENOTEMPTY) {
+				// leftover from a previous process
+				deleted_directories.insert(deleted_path);
+			}
+			else {
+				return errno == ENOENT;
+			}
+		}
+#endif
+	}
+
+#ifndef __EMSCRIPTEN__
+	bool sync_removal(const char *dbname) override {
+		int fd = open_parent_dir(dbname);
+		bool success = fd >= 0 && fsync(fd) == 0;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return success;
+	}
+#endif
+
+	int pending_reclaims() const override {
+		return deleted_directories.size();
+	}
+
+	std::unique_ptr<IdbReclaimTask> begin_reclaim() override {
+		// databases that happen to have a deleted name are left alone while in use
+		std::set<std::string> open_directories;
+		for (auto& it : directories) {
+			if (is_deleted_name(it.first.c_str())) {
+				open_directories.insert(it.first);
+			}
+		}
+		ReclaimTask *task = new ReclaimTask(std::move(deleted_directories), parent_directories, std::move(open_directories));
+		deleted_directories.clear();
+		return std::unique_ptr<IdbReclaimTask>(task);
+	}
+
+private:
+	std::unordered_map<std::string, IdbDirectoryStorage *> directories;
+	std::set<std::string> deleted_directories;
+	std::set<std::string> parent_directories;
+#ifndef __EMSCRIPTEN__
+	int deleted_count = 0;
+#endif
+
+	/**
+	 * Remove all objects inside a directory, keeping the directory itself.
+	 *
+	 * @return Number of removed objects.
+	 */
+	static int remove_directory(const char *path) {
+		int removed_objects = 0;
+		IdbDirectoryStorage directory(path);
+		for (const std::string& key : directory.list()) {
+			if (directory.remove(key.c_str())) {
+				removed_objects++;
+			}
+		}
+		directory.close_all();
+		return removed_objects;
+	}
+
+	static std::string parent_path(const std::string& path) {
+		size_t separator = path.rfind('/');
+		return separator == std::string::npos ? "." : separator == 0 ? "/" : path.substr(0, separator);
+	}
+
+	/**
+	 * Whether `name` ends with "-deleted-<N>".
+	 */
+	static bool is_deleted_name(const char *name) {
+		const char *digits = strrchr(name, '-');
+		if (digits == nullptr || digits[1] == '\0' || digits - name < 8 || strncmp(digits - 8, "-deleted", 8) != 0) {
+			return false;
+		}
+		for (const char *c = digits + 1; *c; c++) {
+			if (*c < '0' || *c > '9') {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Removes deleted directories, and the ones left behind by previous processes next to known databases.
+	 */
+	class ReclaimTask : public IdbReclaimTask {
+	public:
+		ReclaimTask(std::set<std::string> deleted_directories, std::set<std::string> parent_directories, std::set<std::string> open_directories)
+			: deleted_directories(std::move(deleted_directories))
+			, parent_directories(std::move(parent_directories))
+			, open_directories(std::move(open_directories))
+		{
+		}
+
+		int run() override {
+			find_deleted_directories();
+			int removed_objects = 0;
+			for (const std::string& path : deleted_directories) {
+				removed_objects += remove_directory(path.c_str());
+				rmdir(path.c_str());
+			}
+			return removed_objects;
+		}
+
+	private:
+		std::set<std::string> deleted_directories;
+		std::set<std::string> parent_directories;
+		std::set<std::string> open_directories;
+
+		void find_deleted_directories() {
+			for (const std::string& parent : parent_directories) {
+				DIR *dir = opendir(parent.c_str());
+				if (dir == nullptr) {
+					continue;
+				}
+				while (struct dirent *entry = readdir(dir)) {
+					if (!is_deleted_name(entry->d_name)) {
+						continue;
+					}
+					std::string path = parent == "/" ? "/" + std::string(entry->d_name) : parent + "/" + entry->d_name;
+					struct stat st;
+					if (open_directories.count(path) == 0 && stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+						deleted_directories.insert(path);
+					}
+				}
+				closedir(dir);
+			}
+		}
+	};
+};
+
+#ifndef __EMSCRIPTEN__
+/**
+ * Barrier for a container file: the whole file is synced, header included, along with its directory if the file was just created.
+ */
+class IdbContainerSyncTask : public IdbFlushTask {
+public:
+	IdbContainerSyncTask(int fd, int dirfd, int sync_flags) : fd(fd), dirfd(dirfd), sync_flags(sync_flags) {}
+
+	~IdbContainerSyncTask() {
+		if (fd >= 0) {
+			close(fd);
+		}
+		if (dirfd >= 0) {
+			close(dirfd);
+		}
+	}
+
+	bool run() override {
+		if (fd < 0) {
+			return false;
+		}
+		bool success = sync_file(fd, sync_flags);
+		if (dirfd >= 0) {
+			success = fsync(dirfd) == 0 && success;
+		}
+		return success;
+	}
+
+private:
+	int fd;
+	int dirfd;
+	int sync_flags;
+};
+
+/**
+ * Storage that packs the objects of a database into a single container file, for native builds.
+ *
+ * Extents are laid out back to back after a fixed size header, so byte `N` of the
+ * database is at `IDBVFS_CONTAINER_HEADER_SIZE + N` and pages are read and written
+ * with `pread`/`pwrite`, optionally reading from a memory map instead. The size and
+ * extent size objects are kept in slots inside the header. Extents are only removed
+ * from the end of files, so removing an extent also removes the extents after it.
+ */
+class IdbContainerStorage : public IdbStorage {
+public:
+	IdbContainerStorage(const char *path) : path(path) {}
+
+	~IdbContainerStorage() {
+		close_file();
+	}
+
+	int get(const char *key, void *data, size_t data_size, sqlite3_int64 offset) override {
+		int slot = metadata_slot(key);
+		if (slot >= 0) {
+			if (!open_file(false) || offset >= slot_length(slot)) {
+				return 0;
+			}
+			size_t read_bytes = std::min<sqlite3_int64>(data_size, slot_length(slot) - offset);
+			memcpy(data, slot_data(slot) + offset, read_bytes);
+			return read_bytes;
+		}
+
+		sqlite3_int64 position = data_position(key, offset);
+		if (position < 0 || !open_file(false) || position >= file_size) {
+			return 0;
+		}
+		size_t available_bytes = std::min<sqlite3_int64>(data_size, file_size - position);
+		if (mapped_data && position + (sqlite3_int64) available_bytes <= mapped_size) {
+			memcpy(data, mapped_data + position, available_bytes);
+			return available_bytes;
+		}
+		size_t read_bytes = 0;
+		while (read_bytes < available_bytes) {
+			ssize_t result = pread(fd, (uint8_t *) data + read_bytes, available_bytes - read_bytes, position + read_bytes);
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+			if (result <= 0) {
+				break;
+			}
+			read_bytes += result;
+		}
+		return read_bytes;
+	}
+
+	int put(const char *key, const void *data, size_t data_size, sqlite3_int64 offset, bool replace) override {
+		int slot = metadata_slot(key);
+		if (slot >= 0) {
+			size_t new_length = replace ? offset + data_size : std::max<sqlite3_int64>(slot_length(slot), offset + data_size);
+			if (new_length >= IDBVFS_CONTAINER_SLOT_SIZE || !open_file(true)) {
+				return 0;
+			}
+			memcpy(slot_data(slot) + offset, data, data_size);
+			header[slot_offset(slot)] = new_length;
+			if (!write_slot(slot)) {
+				return 0;
+			}
+			if (strcmp(key, IDBVFS_EXTENT_SIZE_KEY) == 0) {
+				load_extent_size();
+			}
+			return data_size;
+		}
+
+		sqlite3_int64 position = data_position(key, offset);
+		if (position < 0 || !open_file(true)) {
+			return 0;
+		}
+		dirty = true;
+		size_t written_bytes = 0;
+		while (written_bytes < data_size) {
+			ssize_t result = pwrite(fd, (const uint8_t *) data + written_bytes, data_size - written_bytes, position + written_bytes);
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+			if (result <= 0) {
+				break;
+			}
+			written_bytes += result;
+		}
+		file_size = std::max<sqlite3_int64>(file_size, position + written_bytes);
+		if (replace && written_bytes == data_size) {
+			truncate(key, offset + data_size);
+		}
+		return written_bytes;
+	}
+
+	bool truncate(const char *key, sqlite3_int64 size) override {
+		int slot = metadata_slot(key);
+		if (slot >= 0) {
+			if (!open_file(false) || size >= slot_length(slot)) {
+				return true;
+			}
+			header[slot_offset(slot)] = size;
+			return write_slot(slot);
+		}
+
+		sqlite3_int64 position = data_position(key, size);
+		if (position < 0) {
+			return false;
+		}
+		if (!open_file(false) || position >= file_size) {
+			return true;
+		}
+		dirty = true;
+		if (ftruncate(fd, position) != 0) {
+			return false;
+		}
+		file_size = position;
+		return true;
+	}
+
+	bool exists(const char *key) override {
+		int slot = metadata_slot(key);
+		if (slot >= 0) {
+			return open_file(false) && slot_length(slot) > 0;
+		}
+		sqlite3_int64 position = data_position(key, 0);
+		return position >= 0 && open_file(false) && position < file_size;
+	}
+
+	bool remove(const char *key) override {
+		return truncate(key, 0);
+	}
+
+	std::vector<std::string> list() override {
+		std::vector<std::string> keys;
+		if (!open_file(false)) {
+			return keys;
+		}
+		for (int slot = 0; slot < (int) metadata_keys().size(); slot++) {
+			if (slot_length(slot) > 0) {
+				keys.push_back(metadata_keys()[slot]);
+			}
+		}
+		sqlite3_int64 data_size = file_size - IDBVFS_CONTAINER_HEADER_SIZE;
+		for (sqlite3_int64 extent = 0; extent * extent_bytes < data_size; extent++) {
+			keys.push_back(std::to_string(extent));
+		}
+		return keys;
+	}
+
+	bool flush(int sync_flags) override {
+		return begin_flush(sync_flags)->run();
+	}
+
+	std::unique_ptr<IdbFlushTask> begin_flush(int sync_flags) override {
+		if (!dirty || fd < 0) {
+			return std::unique_ptr<IdbFlushTask>(new IdbCompletedFlush(true));
+		}
+		// the descriptor is duplicated, so that the file may be closed while it is synced
+		IdbContainerSyncTask *task = new IdbContainerSyncTask(dup(fd), created ? open_parent_dir(path) : -1, sync_flags);
+		dirty = false;
+		created = false;
+		return std::unique_ptr<IdbFlushTask>(task);
+	}
+
+	bool atomic_flush() const override {
+		return false;
+	}
+
+	const std::string& get_path() const {
+		return path;
+	}
+
+	void close_file() {
+		if (mapped_data) {
+			munmap(mapped_data, mapped_size);
+			mapped_data = nullptr;
+		}
+		if (fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+		dirty = false;
+		created = false;
+	}
+
+	int refcount = 0;
+
+private:
+	std::string path;
+	int fd = -1;
+	sqlite3_int64 file_size = 0;
+	sqlite3_int64 extent_bytes = IDBVFS_JOURNAL_SEGMENT_SIZE;
+	uint8_t header[IDBVFS_CONTAINER_HEADER_SIZE];
+	uint8_t *mapped_data = nullptr;
+	sqlite3_int64 mapped_size = 0;
+	/// Whether the file was written since the last flush
+	bool dirty = false;
+	/// Whether the file was created since the last flush
+	bool created = false;
+
+	static const std::vector<std::string>& metadata_keys() {
+		static const std::vector<std::string> keys = { IDBVFS_SIZE_KEY, IDBVFS_EXTENT_SIZE_KEY };
+		return keys;
+	}
+
+	static int metadata_slot(const char *key) {
+		const std::vector<std::string>& keys = metadata_keys();
+		auto it = std::find(keys.begin(), keys.end(), key);
+		return it != keys.end() ? it - keys.begin() : -1;
+	}
+
+	static size_t slot_offset(int slot) {
+		return IDBVFS_CONTAINER_SLOT_SIZE * (slot + 1);
+	}
+
+	sqlite3_int64 slot_length(int slot) const {
+		return header[slot_offset(slot)];
+	}
+
+	uint8_t *slot_data(int slot) {
+		return header + slot_offset(slot) + 1;
+	}
+
+	bool write_slot(int slot) {
+		dirty = true;
+		return pwrite(fd, header + slot_offset(slot), IDBVFS_CONTAINER_SLOT_SIZE, slot_offset(slot)) == IDBVFS_CONTAINER_SLOT_SIZE;
+	}
+
+	/**
+	 * Position in the file of `offset` inside extent `key`, or -1 if `key` is not an extent number.
+	 */
+	sqlite3_int64 data_position(const char *key, sqlite3_int64 offset) const {
+		char *end;
+		long long extent = strtoll(key, &end, 10);
+		if (end == key || *end != '\0' || extent < 0) {
+			return -1;
+		}
+		return IDBVFS_CONTAINER_HEADER_SIZE + extent * extent_bytes + offset;
+	}
+
+	void load_extent_size() {
+		// journals and WAL files have no extent size, and are split into segments instead
+		int slot = metadata_slot(IDBVFS_EXTENT_SIZE_KEY);
+		char text[IDBVFS_CONTAINER_SLOT_SIZE] = {};
+		memcpy(text, slot_data(slot), slot_length(slot));
+		long long extent_size = atoll(text);
+		extent_bytes = extent_size > 0 ? extent_size : IDBVFS_JOURNAL_SEGMENT_SIZE;
+	}
+
+	bool open_file(bool create) {
+		if (fd >= 0) {
+			return true;
+		}
+		fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			if (!create || errno != ENOENT) {
+				return false;
+			}
+			fd = open(path.c_str(), O_RDWR | O_CLOEXEC | O_CREAT, 0666);
+			if (fd < 0) {
+				return false;
+			}
+			created = true;
+			dirty = true;
+			memset(header, 0, sizeof(header));
+			memcpy(header, "idbvfs container", 16);
+			if (pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+				close_file();
+				return false;
+			}
+		}
+		else if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, "idbvfs container", 16) != 0) {
+			// not a container, like a database created by another VFS
+			close_file();
+			return false;
+		}
+		struct stat file_stat;
+		if (fstat(fd, &file_stat) != 0) {
+			close_file();
+			return false;
+		}
+		file_size = file_stat.st_size;
+		load_extent_size();
+		if (IDBVFS_CONTAINER_MMAP_SIZE > 0) {
+			// pages past the end of file are never read from the map, as that would fault
+			void *map = mmap(nullptr, IDBVFS_CONTAINER_MMAP_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+			if (map != MAP_FAILED) {
+				mapped_data = (uint8_t *) map;
+				mapped_size = IDBVFS_CONTAINER_MMAP_SIZE;
+			}
+		}
+		return true;
+	}
+};
+
+/**
+ * Backend that stores each database and each of its journals as a single container file,
+ * named like the files of SQLite's default VFS. Deleted files are unlinked right away,
+ * so there is nothing left to reclaim.
+ */
+class IdbContainerBackend : public IdbBackend {
+public:
+	IdbStorage *acquire(const char *dbname) override {
+		auto it = containers.find(dbname);
+		if (it == containers.end()) {
+			it = containers.emplace(dbname, new IdbContainerStorage(dbname)).first;
+		}
+		it->second->refcount++;
+		return it->second;
+	}
+
+	void release(IdbStorage *storage) override {
+		IdbContainerStorage *container = static_cast<IdbContainerStorage *>(storage);
+		if (container && --container->refcount == 0) {
+			containers.erase(container->get_path());
+			delete container;
+		}
+	}
+
+	bool remove_database(const char *dbname) override {
+		auto it = containers.find(dbname);
+		if (it != containers.end()) {
+			it->second->close_file();
+		}
+		return unlink(dbname) == 0 || errno == ENOENT;
+	}
+
+	bool sync_removal(const char *dbname) override {
+		int fd = open_parent_dir(dbname);
+		bool success = fd >= 0 && fsync(fd) == 0;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return success;
+	}
+
+	int pending_reclaims() const override {
+		return 0;
+	}
+
+	std::unique_ptr<IdbReclaimTask> begin_reclaim() override {
+		return std::unique_ptr<IdbReclaimTask>(new IdbCompletedReclaim(0));
+	}
+
+private:
+	std::unordered_map<std::string, IdbContainerStorage *> containers;
+};
+#endif
+
+/// Objects of a database kept in memory, by key
+typedef std::unordered_map<std::string, std::vector<uint8_t>> IdbObjectMap;
+
+/**
+ * Frees the objects of databases deleted from memory.
+ */
+class IdbObjectMapReclaim : public IdbReclaimTask {
+public:
+	IdbObjectMapReclaim(std::vector<IdbObjectMap> deleted_objects) : deleted_objects(std::move(deleted_objects)) {}
+
+	int run() override {
+		int removed_objects = 0;
+		for (const IdbObjectMap& objects : deleted_objects) {
+			removed_objects += objects.size();
+		}
+		deleted_objects.clear();
+		return removed_objects;
+	}
+
+private:
+	std::vector<IdbObjectMap> deleted_objects;
+};
+
+/**
+ * Storage that keeps objects in memory only.
+ * Useful for measuring VFS logic without any file system costs.
+ */
+class IdbMemoryStorage : public IdbStorage {
+public:
+	int get(const char *key, void *data, size_t data_size, sqlite3_int64 offset) override {
+		auto it = objects.find(key);
+		if (it == objects.end() || offset >= (sqlite3_int64) it->second.size()) {
+			return 0;
+		}
+		size_t read_bytes = std::min<size_t>(data_size, it->second.size() - offset);
+		memcpy(data, it->second.data() + offset, read_bytes);
+		return read_bytes;
+	}
+
+	int put(const char *key, const void *data, size_t data_size, sqlite3_int64 offset, bool replace) override {
+		std::vector<uint8_t>& object = objects[key];
+		size_t end = offset + data_size;
+		if (replace || end > object.size()) {
+			object.resize(end);
+		}
+		memcpy(object.data() + offset, data, data_size);
+		return data_size;
+	}
+
+	bool truncate(const char *key, sqlite3_int64 size) override {
+		auto it = objects.find(key);
+		if (it == objects.end()) {
+			return false;
+		}
+		if ((sqlite3_int64) it->second.size() > size) {
+			it->second.resize(size);
+		}
+		return true;
+	}
+
+	bool exists(const char *key) override {
+		return objects.find(key) != objects.end();
+	}
+
+	bool remove(const char *key) override {
+		return objects.erase(key) > 0;
+	}
+
+	std::vector<std::string> list() override {
+		std::vector<std::string> keys;
+		for (auto& it : objects) {
+			keys.push_back(it.first);
+		}
+		return keys;
+	}
+
+	bool flush(int sync_flags) override {
+		return true;
+	}
+
+	bool atomic_flush() const override {
+		return true;
+	}
+
+	bool empty() const {
+		return objects.empty();
+	}
+
+	/**
+	 * Move all objects out of the storage, leaving it empty.
+	 */
+	IdbObjectMap detach_objects() {
+		IdbObjectMap detached_objects;
+		detached_objects.swap(objects);
+		return detached_objects;
+	}
+
+	int refcount = 0;
+
+protected:
+	IdbObjectMap objects;
+};
+
+/**
+ * Backend that keeps databases in memory for the lifetime of the process.
+ * Storages are only freed when they are released while empty.
+ */
+class IdbMemoryBackend : public IdbBackend {
+public:
+	IdbStorage *acquire(const char *dbname) override {
+		IdbMemoryStorage *& storage = storages[dbname];
+		if (storage == nullptr) {
+			storage = new IdbMemoryStorage();
+		}
+		storage->refcount++;
+		return storage;
+	}
+
+	void release(IdbStorage *storage) override {
+		IdbMemoryStorage *memory_storage = static_cast<IdbMemoryStorage *>(storage);
+		if (memory_storage && --memory_storage->refcount == 0 && memory_storage->empty()) {
+			for (auto it = storages.begin(); it != storages.end(); ++it) {
+				if (it->second == memory_storage) {
+					storages.erase(it);
+					break;
+				}
+			}
+			delete memory_storage;
+		}
+	}
+
+	bool remove_database(const char *dbname) override {
+		auto it = storages.find(dbname);
+		if (it == storages.end() || it->second->empty()) {
+			return true;
+		}
+		deleted_objects.push_back(it->second->detach_objects());
+		if (it->second->refcount == 0) {
+			delete it->second;
+			storages.erase(it);
+		}
+		return true;
+	}
+
+	int pending_reclaims() const override {
+		return deleted_objects.size();
+	}
+
+	std::unique_ptr<IdbReclaimTask> begin_reclaim() override {
+		IdbReclaimTask *task = new IdbObjectMapReclaim(std::move(deleted_objects));
+		deleted_objects.clear();
+		return std::unique_ptr<IdbReclaimTask>(task);
+	}
+
+private:
+	std::unordered_map<std::string, IdbMemoryStorage *> storages;
+	std::vector<IdbObjectMap> deleted_objects;
+};
+
+/**
+ * Key-value store persisted by `IdbKeyValueBackend`.
+ *
+ * Puts and removes are batched until `commit`, which must persist all of them at once.
+ */
+class IdbKeyValueStore {
+public:
+	virtual ~IdbKeyValueStore() {}
+
+	/**
+	 * Load all persisted values whose key starts with `prefix`, with the prefix removed from their keys.
+	 */
+	virtual void load(const std::string& prefix, IdbObjectMap& out_values) = 0;
+
+	virtual void put(const std::string& key, const std::vector<uint8_t>& value) = 0;
+
+	virtual void remove(const std::string& key) = 0;
+
+	/**
+	 * Remove all values whose key starts with `prefix`, including pending puts.
+	 * Prefix removals are committed before the puts and removes that follow them.
+	 */
+	virtual void remove_prefix(const std::string& prefix) = 0;
+
+	virtual bool commit() = 0;
+
+	/**
+	 * Whether persisted values can be loaded.
+	 * Stores that load asynchronously are not ready until their initial load completes.
+	 */
+	virtual bool ready() {
+		return true;
+	}
+};
+
+#ifdef __EMSCRIPTEN__
+EM_JS(int, idbvfs_kv_load_begin, (const char *prefix), {
+	var kv = Module.idbvfsKv;
+	var keyPrefix = UTF8ToString(prefix);
+	kv.loading = [];
+	kv.data.forEach(function(value, key) {
+		if (key.startsWith(keyPrefix)) {
+			kv.loading.push([key, key.substring(keyPrefix.length), value]);
+		}
+	});
+	return kv.loading.length;
+});
+EM_JS(int, idbvfs_kv_load_key_length, (int index), {
+	return Module.idbvfsKv.loading[index][1].length;
+});
+EM_JS(int, idbvfs_kv_load_value_length, (int index), {
+	return Module.idbvfsKv.loading[index][2].length;
+});
+EM_JS(void, idbvfs_kv_load_entry, (int index, char *key, uint8_t *value), {
+	var entry = Module.idbvfsKv.loading[index];
+	// keys are ASCII: page numbers and idbvfs metadata names
+	for (var i = 0; i < entry[1].length; i++) {
+		HEAPU8[key + i] = entry[1].charCodeAt(i);
+	}
+	HEAPU8.set(entry[2], value);
+});
+EM_JS(void, idbvfs_kv_load_end, (), {
+	var kv = Module.idbvfsKv;
+	// loaded values are owned by idbvfs from now on
+	kv.loading.forEach(function(entry) {
+		kv.data.delete(entry[0]);
+	});
+	kv.loading = null;
+});
+EM_JS(void, idbvfs_kv_put, (const char *key, const uint8_t *value, int value_length), {
+	Module.idbvfsKv.pending.set(UTF8ToString(key), HEAPU8.slice(value, value + value_length));
+});
+EM_JS(void, idbvfs_kv_remove, (const char *key), {
+	Module.idbvfsKv.pending.set(UTF8ToString(key), null);
+});
+EM_JS(void, idbvfs_kv_remove_prefix, (const char *prefix), {
+	var kv = Module.idbvfsKv;
+	var keyPrefix = UTF8ToString(prefix);
+	kv.pending.forEach(function(value, key) {
+		if (key.startsWith(keyPrefix)) {
+			kv.pending.delete(key);
+		}
+	});
+	kv.data.forEach(function(value, key) {
+		if (key.startsWith(keyPrefix)) {
+			kv.data.delete(key);
+		}
+	});
+	kv.pendingPrefixRemovals.push(keyPrefix);
+});
+EM_JS(void, idbvfs_kv_commit, (), {
+	Module.idbvfsKv.commit();
+});
+EM_JS(int, idbvfs_kv_ready, (), {
+	return Module.idbvfsKv.loaded ? 1 : 0;
+});
+
+/**
+ * Key-value store that persists values in an Indexed DB object store,
+ * writing all pending changes in a single Indexed DB transaction on commit.
+ */
+class IdbIndexedDbStore : public IdbKeyValueStore {
+public:
+	void load(const std::string& prefix, IdbObjectMap& out_values) override {
+		int count = idbvfs_kv_load_begin(prefix.c_str());
+		for (int i = 0; i < count; i++) {
+			std::string key(idbvfs_kv_load_key_length(i), '\0');
+			std::vector<uint8_t> value(idbvfs_kv_load_value_length(i));
+			idbvfs_kv_load_entry(i, &key[0], value.data());
+			out_values[key] = std::move(value);
+		}
+		idbvfs_kv_load_end();
+	}
+
+	void put(const std::string& key, const std::vector<uint8_t>& value) override {
+		idbvfs_kv_put(key.c_str(), value.data(), value.size());
+	}
+
+	void remove(const std::string& key) override {
+		idbvfs_kv_remove(key.c_str());
+	}
+
+	void remove_prefix(const std::string& prefix) override {
+		idbvfs_kv_remove_prefix(prefix.c_str());
+	}
+
+	bool commit() override {
+		idbvfs_kv_commit();
+		return true;
+	}
+
+	bool ready() override {
+		return idbvfs_kv_ready();
+	}
+};
+#endif
+
+/**
+ * In-process stand-in for a persistent key-value store.
+ * Values survive closing databases, but not the process.
+ */
+class IdbLocalKeyValueStore : public IdbKeyValueStore {
+public:
+	void load(const std::string& prefix, IdbObjectMap& out_values) override {
+		// values removed by a pending prefix removal are already gone
+		for (const std::string& removed_prefix : pending_prefix_removals) {
+			if (prefix.compare(0, removed_prefix.size(), removed_prefix) == 0) {
+				return;
+			}
+		}
+		for (auto it = values.lower_bound(prefix); it != values.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+			out_values[it->first.substr(prefix.size())] = it->second;
+		}
+	}
+
+	void put(const std::string& key, const std::vector<uint8_t>& value) override {
+		pending[key] = std::make_pair(true, value);
+	}
+
+	void remove(const std::string& key) override {
+		pending[key] = std::make_pair(false, std::vector<uint8_t>());
+	}
+
+	void remove_prefix(const std::string& prefix) override {
+		erase_prefix(pending, prefix);
+		pending_prefix_removals.push_back(prefix);
+	}
+
+	bool commit() override {
+		for (const std::string& prefix : pending_prefix_removals) {
+			erase_prefix(values, prefix);
+		}
+		pending_prefix_removals.clear();
+		for (auto& it : pending) {
+			if (it.second.first) {
+				values[it.first] = std::move(it.second.second);
+			}
+			else {
+				values.erase(it.first);
+			}
+		}
+		pending.clear();
+		return true;
+	}
+
+private:
+	std::map<std::string, std::vector<uint8_t>> values;
+	std::map<std::string, std::pair<bool, std::vector<uint8_t>>> pending;
+	std::vector<std::string> pending_prefix_removals;
+
+	template<typename Map>
+	static void erase_prefix(Map& map, const std::string& prefix) {
+		auto it = map.lower_bound(prefix);
+		while (it != map.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+			it = map.erase(it);
+		}
+	}
+};
+
+class IdbKeyValueBackend;
+
+/**
+ * Storage that keeps database objects in memory, recording which keys were
+ * put or removed so that the key-value backend persists only those.
+ */
+class IdbKeyValueStorage : public IdbMemoryStorage {
+public:
+	IdbKeyValueStorage(IdbKeyValueBackend *backend, const std::string& dbname)
+		: backend(backend)
+		, prefix(dbname + "/")
+	{
+	}
+
+	int put(const char *key, const void *data, size_t data_size, sqlite3_int64 offset, bool replace) override {
+		dirty_keys.insert(key);
+		return IdbMemoryStorage::put(key, data, data_size, offset, replace);
+	}
+
+	bool truncate(const char *key, sqlite3_int64 size) override {
+		dirty_keys.insert(key);
+		return IdbMemoryStorage::truncate(key, size);
+	}
+
+	bool remove(const char *key) override {
+		if (IdbMemoryStorage::remove(key)) {
+			dirty_keys.insert(key);
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+
+	bool flush(int sync_flags) override;
+
+private:
+	IdbKeyValueBackend *backend;
+	std::string prefix;
+	std::set<std::string> dirty_keys;
+
+	friend class IdbKeyValueBackend;
+};
+
+/**
+ * Backend that keeps databases in memory, persisting them to a key-value store.
+ *
+ * Objects of a database are loaded when its storage is first acquired. Flushing
+ * any storage is a persistence barrier for the whole backend: only the keys put
+ * or removed since the last barrier are written to the store, in a single commit,
+ * so that commit cost depends on the amount of changed data instead of the total.
+ */
+class IdbKeyValueBackend : public IdbBackend {
+public:
+	IdbKeyValueBackend(IdbKeyValueStore *store) : store(store) {}
+
+	IdbStorage *acquire(const char *dbname) override {
+		IdbKeyValueStorage *& storage = storages[dbname];
+		if (storage == nullptr) {
+			storage = new IdbKeyValueStorage(this, dbname);
+			store->load(storage->prefix, storage->objects);
+		}
+		storage->refcount++;
+		return storage;
+	}
+
+	bool ready() override {
+		return store->ready();
+	}
+
+	void release(IdbStorage *storage) override {
+		IdbKeyValueStorage *kv_storage = static_cast<IdbKeyValueStorage *>(storage);
+		if (kv_storage && --kv_storage->refcount == 0) {
+			free_if_unused(kv_storage);
+		}
+	}
+
+	bool remove_database(const char *dbname) override {
+		std::string prefix = std::string(dbname) + "/";
+		auto it = storages.find(dbname);
+		if (it != storages.end()) {
+			IdbKeyValueStorage *storage = it->second;
+			deleted_objects.push_back(storage->detach_objects());
+			storage->dirty_keys.clear();
+			if (storage->refcount == 0) {
+				delete storage;
+				storages.erase(it);
+			}
+		}
+		// a single range removal, instead of one removal per object
+		store->remove_prefix(prefix);
+		has_prefix_removals = true;
+		return true;
+	}
+
+	int pending_reclaims() const override {
+		return deleted_objects.size();
+	}
+
+	std::unique_ptr<IdbReclaimTask> begin_reclaim() override {
+		IdbReclaimTask *task = new IdbObjectMapReclaim(std::move(deleted_objects));
+		deleted_objects.clear();
+		return std::unique_ptr<IdbReclaimTask>(task);
+	}
+
+	bool flush() {
+		bool has_changes = has_prefix_removals;
+		has_prefix_removals = false;
+		for (auto& it : storages) {
+			IdbKeyValueStorage *storage = it.second;
+			for (const std::string& key : storage->dirty_keys) {
+				auto object = storage->objects.find(key);
+				if (object != storage->objects.end()) {
+					store->put(storage->prefix + key, object->second);
+					idbvfs_global_stats.kv_objects_put++;
+				}
+				else {
+					store->remove(storage->prefix + key);
+					idbvfs_global_stats.kv_objects_removed++;
+				}
+				has_changes = true;
+			}
+			storage->dirty_keys.clear();
+		}
+		if (!has_changes) {
+			return true;
+		}
+		idbvfs_global_stats.kv_commits++;
+		bool success = store->commit();
+
+		for (auto it = storages.begin(); it != storages.end(); ) {
+			IdbKeyValueStorage *storage = (it++)->second;
+			if (storage->refcount == 0) {
+				free_if_unused(storage);
+			}
+		}
+		return success;
+	}
+
+private:
+	IdbKeyValueStore *store;
+	std::unordered_map<std::string, IdbKeyValueStorage *> storages;
+	std::vector<IdbObjectMap> deleted_objects;
+	bool has_prefix_removals = false;
+
+	/**
+	 * Free storages of deleted databases, once their removals are persisted.
+	 */
+	void free_if_unused(IdbKeyValueStorage *storage) {
+		if (storage->empty() && storage->dirty_keys.empty()) {
+			storages.erase(storage->prefix.substr(0, storage->prefix.size() - 1));
+			delete storage;
+		}
+	}
+};
+
+bool IdbKeyValueStorage::flush(int sync_flags) {
+	return backend->flush();
+}
+
+class IdbPage {
+public:
+	IdbPage() {}
+
+	IdbPage(IdbStorage *storage, const char *subfilename)
+		: storage(storage)
+		, filename(subfilename)
+	{
+	}
+
+	IdbPage(IdbStorage *storage, int page_number)
+		: IdbPage(storage, std::to_string(page_number).c_str())
+	{
+	}
+
+	bool exists() const {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		return storage->exists(filename.c_str());
+	}
+
+	int load_into(void *data, size_t data_size, sqlite3_int64 offset_in_page = 0) const {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		idbvfs_global_stats.objects_read++;
+		return storage->get(filename.c_str(), data, data_size, offset_in_page);
+	}
+
+	int load_into(std::vector<uint8_t>& out_buffer, size_t data_size) const {
+		out_buffer.resize(data_size);
+		return load_into(out_buffer.data(), data_size);
+	}
+
+	int scan_into(const char *fmt, ...) const {
+		char buffer[64];
+		int read_bytes = load_into(buffer, sizeof(buffer) - 1);
+		if (read_bytes <= 0) {
+			return 0;
+		}
+		buffer[read_bytes] = '\0';
+
+		va_list args;
+		va_start(args, fmt);
+		int assigned_items = vsscanf(buffer, fmt, args);
+		va_end(args);
+		return assigned_items;
+	}
+
+	int store(const void *data, size_t data_size) const {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		idbvfs_global_stats.objects_written++;
+		return storage->put(filename.c_str(), data, data_size, 0, true);
+	}
+
+	int store(const std::vector<uint8_t>& data) const {
+		return store(data.data(), data.size());
+	}
+
+	/**
+	 * Store data at `offset` inside the file, keeping the rest of its contents.
+	 */
+	int store_at(const void *data, size_t data_size, sqlite3_int64 offset) const {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		idbvfs_global_stats.objects_written++;
+		return storage->put(filename.c_str(), data, data_size, offset, false);
+	}
+
+	int store(const std::string& data) const {
+		return store(data.c_str(), data.size());
+	}
+
+	bool truncate(sqlite3_int64 size) const {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		return storage->truncate(filename.c_str(), size);
+	}
+
+	bool remove() const {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		return storage->remove(filename.c_str());
+	}
+
+protected:
+	IdbStorage *storage;
+	std::string filename;
+};
+
+struct IdbFileSize : public IdbPage {
+	IdbFileSize() : IdbPage() {}
+
+	/**
+	 * @param shared  Whether the size is kept in the storage for all of its connections, for files they all append to.
+	 *                Shared sizes are released with `release`.
+	 */
+	IdbFileSize(IdbStorage *storage, bool autoload = true, bool shared = false)
+		: IdbPage(storage, IDBVFS_SIZE_KEY)
+		, shared(shared)
+	{
+		if (shared) {
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			if (storage->shared_size.users++ == 0) {
+				load();
+			}
+		}
+		else if (autoload) {
+			load();
+		}
+	}
+
+	void release() {
+		if (shared) {
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			storage->shared_size.users--;
+		}
+	}
+
+	void load() {
+		std::unique_lock<std::recursive_mutex> guard = lock_shared();
+		IdbFileSizeState& state = get_state();
+		state.size = 0;
+		scan_into("%lu", &state.size);
+		state.is_dirty = false;
+	}
+
+	size_t get() {
+		std::unique_lock<std::recursive_mutex> guard = lock_shared();
+		return get_state().size;
+	}
+
+	void set(size_t new_file_size) {
+		std::unique_lock<std::recursive_mutex> guard = lock_shared();
+		IdbFileSizeState& state = get_state();
+		if (new_file_size != state.size) {
+			state.size = new_file_size;
+			state.is_dirty = true;
+		}
+	}
+
+	void update_if_greater(size_t new_file_size) {
+		std::unique_lock<std::recursive_mutex> guard = lock_shared();
+		if (new_file_size > get_state().size) {
+			set(new_file_size);
+		}
+	}
+
+	/**
+	 * Whether the size can be derived from the file contents, like the page count in a database header.
+	 * Derived sizes are kept up to date in memory, but never stored.
+	 */
+	void set_derived(bool derived) {
+		// the stored size may be stale when it stops being derived
+		if (is_derived && !derived) {
+			local.is_dirty = true;
+		}
+		is_derived = derived;
+	}
+
+	bool sync() {
+		std::unique_lock<std::recursive_mutex> guard = lock_shared();
+		IdbFileSizeState& state = get_state();
+		if (!state.is_dirty || is_derived) {
+			return true;
+		}
+		if (store(std::to_string(state.size)) <= 0) {
+			return false;
+		}
+		state.is_dirty = false;
+		return true;
+	}
+
+private:
+	IdbFileSizeState local;
+	bool shared = false;
+	bool is_derived = false;
+
+	IdbFileSizeState& get_state() {
+		return shared ? storage->shared_size : local;
+	}
+
+	std::unique_lock<std::recursive_mutex> lock_shared() {
+		return shared ? std::unique_lock<std::recursive_mutex>(idbvfs_storage_mutex) : std::unique_lock<std::recursive_mutex>();
+	}
+};
+
+/**
+ * Size in bytes of each extent file of a database.
+ *
+ * Database contents are split into extents of a fixed size, with byte `N`
+ * being stored inside extent file `N / extent_size`. The extent size is
+ * persisted when the database is created, so that the layout does not
+ * depend on the current page size. Databases created before extents were
+ * introduced store one page per file, so their extent size is the page
+ * size found in the database header.
+ */
+struct IdbExtentSize : public IdbPage {
+	IdbExtentSize() : IdbPage() {}
+	IdbExtentSize(IdbStorage *storage) : IdbPage(storage, IDBVFS_EXTENT_SIZE_KEY) {}
+
+	/**
+	 * Get the extent size, or 0 if the database has no data yet.
+	 */
+	sqlite3_int64 get() {
+		if (extent_size == 0) {
+			if (scan_into("%lld", &extent_size) != 1) {
+				extent_size = load_legacy_page_size();
+			}
+		}
+		return extent_size;
+	}
+
+	bool init(sqlite3_int64 new_extent_size) {
+		extent_size = new_extent_size;
+		return store(std::to_string(extent_size)) > 0;
+	}
+
+private:
+	sqlite3_int64 extent_size = 0;
+
+	sqlite3_int64 load_legacy_page_size() const {
+		// page size is a big-endian 2 byte integer at offset 16, with 1 meaning 65536
+		uint8_t page_size_bytes[2];
+		IdbPage first_page(storage, 0);
+		if (first_page.load_into(page_size_bytes, sizeof(page_size_bytes), 16) < (int) sizeof(page_size_bytes)) {
+			return 0;
+		}
+		int page_size = (page_size_bytes[0] << 8) | page_size_bytes[1];
+		return page_size == 1 ? 65536 : page_size;
+	}
+};
+
+/**
+ * Bounded LRU cache of database contents.
+ *
+ * Entries are byte ranges keyed by their offset in the file, usually whole
+ * pages, and never overlap each other. Reads are served from the entry that
+ * contains the whole requested range, so that small reads like the database
+ * header are served from the cached first page.
+ */
+class IdbPageCache {
+public:
+	IdbPageCache(size_t max_pages = 0) : max_pages(max_pages) {}
+
+	bool read(void *data, size_t data_size, sqlite3_int64 offset) {
+		auto it = find_containing(offset);
+		if (it == index.end()) {
+			return false;
+		}
+		sqlite3_int64 offset_in_entry = offset - it->first;
+		const IdbBuffer& entry_data = it->second->data;
+		if (offset_in_entry + data_size > entry_data.size()) {
+			return false;
+		}
+		entries.splice(entries.begin(), entries, it->second);
+		memcpy(data, entry_data.data() + offset_in_entry, data_size);
+		return true;
+	}
+
+	/**
+	 * Update the entry with the same offset and size, if there is one.
+	 */
+	bool replace(const void *data, size_t data_size, sqlite3_int64 offset) {
+		auto it = index.find(offset);
+		if (it == index.end() || it->second->data.size() != data_size) {
+			return false;
+		}
+		entries.splice(entries.begin(), entries, it->second);
+		memcpy(entries.front().data.data(), data, data_size);
+		return true;
+	}
+
+	void store(const void *data, size_t data_size, sqlite3_int64 offset) {
+		if (max_pages == 0) {
+			return;
+		}
+
+		auto it = index.find(offset);
+		if (it != index.end() && it->second->data.size() == data_size) {
+			entries.splice(entries.begin(), entries, it->second);
+		}
+		else {
+			remove_range(offset, offset + data_size);
+			if (entries.size() >= max_pages) {
+				index.erase(entries.back().offset);
+				entries.pop_back();
+			}
+			entries.emplace_front();
+			entries.front().offset = offset;
+			index[offset] = entries.begin();
+		}
+		entries.front().data.assign(data, data_size);
+	}
+
+	void invalidate(sqlite3_int64 offset, size_t data_size) {
+		remove_range(offset, offset + data_size);
+	}
+
+	void truncate(sqlite3_int64 size) {
+		remove_range(size, INT64_MAX);
+	}
+
+	void clear() {
+		entries.clear();
+		index.clear();
+	}
+
+	size_t size() const {
+		return entries.size();
+	}
+
+	size_t get_max_pages() const {
+		return max_pages;
+	}
+
+	void set_max_pages(size_t new_max_pages) {
+		max_pages = new_max_pages;
+		while (entries.size() > max_pages) {
+			evict();
+		}
+	}
+
+	/**
+	 * Remove the least recently used entry.
+	 * @return Whether there was an entry to remove.
+	 */
+	bool evict() {
+		if (entries.empty()) {
+			return false;
+		}
+		index.erase(entries.back().offset);
+		entries.pop_back();
+		return true;
+	}
+
+private:
+	struct Entry {
+		sqlite3_int64 offset;
+		IdbBuffer data;
+	};
+	std::list<Entry> entries;
+	std::map<sqlite3_int64, std::list<Entry>::iterator> index;
+	size_t max_pages;
+
+	std::map<sqlite3_int64, std::list<Entry>::iterator>::iterator find_containing(sqlite3_int64 offset) {
+		auto it = index.upper_bound(offset);
+		if (it == index.begin()) {
+			return index.end();
+		}
+		--it;
+		if (offset >= it->first + (sqlite3_int64) it->second->data.size()) {
+			return index.end();
+		}
+		return it;
+	}
+
+	/**
+	 * Remove all entries that overlap the [`start`, `end`) range.
+	 */
+	void remove_range(sqlite3_int64 start, sqlite3_int64 end) {
+		auto it = find_containing(start);
+		if (it == index.end()) {
+			it = index.lower_bound(start);
+		}
+		while (it != index.end() && it->first < end) {
+			entries.erase(it->second);
+			it = index.erase(it);
+		}
+	}
+};
+
+/**
+ * Page cache shared by all connections to a database in the process.
+ *
+ * Entries are spread over shards with their own locks, so that readers on
+ * different threads rarely wait for each other. The size limit applies to
+ * the whole cache, so that pages hashed to the same shard don't evict each
+ * other while the others have room. Connections store the pages
+ * they write, which SQLite's locking guarantees no other connection is
+ * reading at the time, so the cache never holds stale pages.
+ */
+class IdbSharedPageCache {
+public:
+	static IdbSharedPageCache *acquire(IdbBackend *backend, const char *dbname, size_t max_pages) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		IdbSharedPageCache*& cache = registry[std::make_pair(backend, std::string(dbname))];
+		if (cache == nullptr) {
+			cache = new IdbSharedPageCache(backend, dbname);
+		}
+		cache->refcount++;
+		// connections asking for a bigger cache grow it for everyone, any shard may hold all of its pages
+		for (Shard& shard : cache->shards) {
+			std::lock_guard<std::mutex> shard_guard(shard.mutex);
+			if (shard.pages.get_max_pages() < max_pages) {
+				shard.pages.set_max_pages(max_pages);
+			}
+		}
+		if (cache->max_pages < max_pages) {
+			cache->max_pages = max_pages;
+		}
+		return cache;
+	}
+
+	static void release(IdbSharedPageCache *cache) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		if (--cache->refcount == 0) {
+			registry.erase(std::make_pair(cache->backend, cache->dbname));
+			delete cache;
+		}
+	}
+
+	bool read(void *data, size_t data_size, sqlite3_int64 offset) {
+		Shard& shard = shard_for(offset);
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		return shard.pages.read(data, data_size, offset);
+	}
+
+	void store(const void *data, size_t data_size, sqlite3_int64 offset) {
+		Shard& shard = shard_for(offset);
+		{
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			if (shard.pages.get_max_pages() == 0 || shard.pages.replace(data, data_size, offset)) {
+				return;
+			}
+		}
+		// entries of another size, e.g. from before the page size changed, may be in any shard
+		invalidate(offset, data_size);
+		{
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			size_t size_before = shard.pages.size();
+			shard.pages.store(data, data_size, offset);
+			// the new page itself is dropped if nothing else can be
+			while (idbvfs_memory.exceeded() && shard.pages.evict()) {
+				idbvfs_memory.count_eviction();
+			}
+			// memory used by SQLite shrinks the cache gradually, keeping the new page
+			if (idbvfs_memory.under_pressure() && shard.pages.size() > 1 && shard.pages.evict()) {
+				idbvfs_memory.count_eviction();
+			}
+			cached_pages += shard.pages.size() - size_before;
+		}
+		// the least recently used page of each shard in turn, approximating the least recently used of the cache
+		while (cached_pages > max_pages) {
+			Shard& victim = shards[next_victim++ % IDBVFS_PAGE_CACHE_SHARDS];
+			std::lock_guard<std::mutex> guard(victim.mutex);
+			if (victim.pages.evict()) {
+				cached_pages--;
+			}
+		}
+	}
+
+	/**
+	 * Evict pages from the caches of all databases until `bytes` of memory are freed, or they are empty.
+	 * @return Number of bytes freed.
+	 */
+	static long long release_memory(long long bytes) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		long long used_before = idbvfs_memory.get_used();
+		bool evicted = true;
+		while (evicted && used_before - idbvfs_memory.get_used() < bytes) {
+			// one page from each shard at a time, so that every database keeps its most recently used pages
+			evicted = false;
+			for (auto& it : registry) {
+				for (Shard& shard : it.second->shards) {
+					std::lock_guard<std::mutex> shard_guard(shard.mutex);
+					if (shard.pages.evict()) {
+						it.second->cached_pages--;
+						idbvfs_memory.count_eviction();
+						evicted = true;
+					}
+				}
+			}
+		}
+		return std::max(0ll, used_before - idbvfs_memory.get_used());
+	}
+
+	void invalidate(sqlite3_int64 offset, size_t data_size) {
+		for (Shard& shard : shards) {
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			size_t size_before = shard.pages.size();
+			shard.pages.invalidate(offset, data_size);
+			cached_pages -= size_before - shard.pages.size();
+		}
+	}
+
+	void truncate(sqlite3_int64 size) {
+		for (Shard& shard : shards) {
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			size_t size_before = shard.pages.size();
+			shard.pages.truncate(size);
+			cached_pages -= size_before - shard.pages.size();
+		}
+	}
+
+private:
+	struct Shard {
+		std::mutex mutex;
+		IdbPageCache pages;
+	};
+	IdbBackend *backend;
+	std::string dbname;
+	int refcount = 0;
+	Shard shards[IDBVFS_PAGE_CACHE_SHARDS];
+	std::atomic<size_t> max_pages{0};
+	// pages in all shards, updated under the lock of the shard that changed
+	std::atomic<size_t> cached_pages{0};
+	std::atomic<size_t> next_victim{0};
+
+	static std::mutex registry_mutex;
+	static std::map<std::pair<IdbBackend *, std::string>, IdbSharedPageCache *> registry;
+
+	IdbSharedPageCache(IdbBackend *backend, const char *dbname)
+		: backend(backend)
+		, dbname(dbname)
+	{
+	}
+
+	Shard& shard_for(sqlite3_int64 offset) {
+		// pages start at multiples of 512 bytes, small reads inside the first page go to its shard
+		uint64_t block = (uint64_t) offset >> 9;
+		return shards[((block * 0x9E3779B97F4A7C15ull) >> 32) % IDBVFS_PAGE_CACHE_SHARDS];
+	}
+};
+
+std::mutex IdbSharedPageCache::registry_mutex;
+std::map<std::pair<IdbBackend *, std::string>, IdbSharedPageCache *> IdbSharedPageCache::registry;
+
+/**
+ * Database pages shared with SQLite by xFetch, emulating a memory mapping.
+ *
+ * Only the first `limit` bytes of the file are mapped, as configured with
+ * `PRAGMA mmap_size`. Pages are loaded once and kept until the file is
+ * closed or unmapped, and are never moved in memory while SQLite holds a
+ * reference to them. Writes update them in place, so that like a real
+ * memory mapping they always reflect the current file contents.
+ *
+ * Pages are drawn from the memory budget, and no new pages are mapped while
+ * it is exceeded, so SQLite reads them with xRead instead.
+ */
+class IdbMappedPages {
+public:
+	sqlite3_int64 get_limit() const {
+		return limit;
+	}
+
+	void set_limit(sqlite3_int64 new_limit) {
+		limit = new_limit;
+		remove_unused(limit, INT64_MAX);
+	}
+
+	bool covers(sqlite3_int64 offset, size_t data_size) const {
+		return offset + (sqlite3_int64) data_size <= limit;
+	}
+
+	/**
+	 * Get a reference to the page at `offset`, or nullptr if it is not loaded.
+	 */
+	uint8_t *acquire(sqlite3_int64 offset, size_t data_size) {
+		auto it = pages.find(offset);
+		if (it == pages.end() || it->second.data.size() != data_size) {
+			return nullptr;
+		}
+		it->second.refcount++;
+		return it->second.data.data();
+	}
+
+	/**
+	 * Take ownership of a loaded page and get a reference to it.
+	 *
+	 * @return Pointer to the page data, or nullptr if it overlaps pages still referenced by SQLite.
+	 */
+	uint8_t *acquire(sqlite3_int64 offset, IdbBuffer& data) {
+		if (!remove_unused(offset, offset + data.size())) {
+			return nullptr;
+		}
+		Page& page = pages[offset];
+		page.data.swap(data);
+		page.refcount = 1;
+		return page.data.data();
+	}
+
+	void release(sqlite3_int64 offset) {
+		auto it = pages.find(offset);
+		if (it != pages.end() && it->second.refcount > 0) {
+			it->second.refcount--;
+		}
+	}
+
+	bool read(void *data, size_t data_size, sqlite3_int64 offset) const {
+		auto it = pages.upper_bound(offset);
+		if (it == pages.begin()) {
+			return false;
+		}
+		--it;
+		sqlite3_int64 offset_in_page = offset - it->first;
+		if (offset_in_page + data_size > it->second.data.size()) {
+			return false;
+		}
+		memcpy(data, it->second.data.data() + offset_in_page, data_size);
+		return true;
+	}
+
+	/**
+	 * Update loaded pages that overlap the range, and keep a copy of it if it is inside the mapped range.
+	 */
+	void store(const void *data, size_t data_size, sqlite3_int64 offset) {
+		update(data, data_size, offset);
+		auto it = pages.find(offset);
+		if (it != pages.end() && it->second.data.size() == data_size) {
+			return;
+		}
+		if (covers(offset, data_size) && !idbvfs_memory.exceeded() && remove_unused(offset, offset + data_size)) {
+			pages[offset].data.assign(data, data_size);
+		}
+	}
+
+	void truncate(sqlite3_int64 size) {
+		remove_unused(size, INT64_MAX);
+	}
+
+	/**
+	 * Remove pages that overlap the [`start`, `end`) range and are not referenced by SQLite.
+	 *
+	 * @return Whether all pages in range were removed.
+	 */
+	bool remove_unused(sqlite3_int64 start, sqlite3_int64 end) {
+		bool removed_all = true;
+		auto it = pages.upper_bound(start);
+		if (it != pages.begin() && std::prev(it)->first + (sqlite3_int64) std::prev(it)->second.data.size() > start) {
+			--it;
+		}
+		while (it != pages.end() && it->first < end) {
+			if (it->second.refcount > 0) {
+				removed_all = false;
+				++it;
+			}
+			else {
+				it = pages.erase(it);
+			}
+		}
+		return removed_all;
+	}
+
+private:
+	struct Page {
+		IdbBuffer data;
+		int refcount = 0;
+	};
+	std::map<sqlite3_int64, Page> pages;
+	sqlite3_int64 limit = 0;
+
+	void update(const void *data, size_t data_size, sqlite3_int64 offset) {
+		sqlite3_int64 end = offset + data_size;
+		auto it = pages.upper_bound(offset);
+		if (it != pages.begin()) {
+			--it;
+		}
+		for (; it != pages.end() && it->first < end; ++it) {
+			sqlite3_int64 start = std::max(offset, it->first);
+			sqlite3_int64 stop = std::min<sqlite3_int64>(end, it->first + it->second.data.size());
+			if (start < stop) {
+				memcpy(it->second.data.data() + (start - it->first), (const uint8_t *) data + (start - offset), stop - start);
+			}
+		}
+	}
+};
+
+/**
+ * Database writes that were not stored yet, keyed by offset.
+ *
+ * Buffered writes are stored in offset order when the file is synced or
+ * when the buffer is full, so that pages rewritten several times in a
+ * transaction are only stored once.
+ */
+class IdbWriteBuffer {
+public:
+	IdbWriteBuffer(size_t max_pages = 0) : max_pages(max_pages) {}
+
+	bool enabled() const {
+		return max_pages > 0;
+	}
+
+	bool empty() const {
+		return pages.empty();
+	}
+
+	bool full() const {
+		return pages.size() >= max_pages;
+	}
+
+	bool read(void *data, size_t data_size, sqlite3_int64 offset) const {
+		auto it = pages.upper_bound(offset);
+		if (it == pages.begin()) {
+			return false;
+		}
+		--it;
+		sqlite3_int64 offset_in_page = offset - it->first;
+		if (offset_in_page + data_size > it->second.size()) {
+			return false;
+		}
+		memcpy(data, it->second.data() + offset_in_page, data_size);
+		return true;
+	}
+
+	/**
+	 * Whether the [`offset`, `offset + data_size`) range overlaps any buffered write.
+	 * When `allow_exact_match` is true, a buffered write with exactly the same range is not considered.
+	 */
+	bool overlaps(sqlite3_int64 offset, size_t data_size, bool allow_exact_match = false) const {
+		auto it = pages.upper_bound(offset);
+		if (it != pages.begin()) {
+			auto previous = std::prev(it);
+			if (previous->first + (sqlite3_int64) previous->second.size() > offset
+				&& !(allow_exact_match && previous->first == offset && previous->second.size() == data_size))
+			{
+				return true;
+			}
+		}
+		return it != pages.end() && it->first < offset + (sqlite3_int64) data_size;
+	}
+
+	void write(const void *data, size_t data_size, sqlite3_int64 offset) {
+		pages[offset].assign(data, data_size);
+	}
+
+	void clear() {
+		pages.clear();
+	}
+
+	void truncate(sqlite3_int64 size) {
+		auto it = pages.lower_bound(size);
+		pages.erase(it, pages.end());
+		if (!pages.empty()) {
+			auto last = std::prev(pages.end());
+			if (last->first + (sqlite3_int64) last->second.size() > size) {
+				last->second.resize(size - last->first);
+			}
+		}
+	}
+
+	/**
+	 * Store all buffered writes in offset order using `store(data, data_size, offset)`.
+	 * Writes that fail to be stored are kept in the buffer.
+	 */
+	template<typename StoreFunction>
+	bool flush(StoreFunction store) {
+		for (auto it = pages.begin(); it != pages.end(); ) {
+			if (!store(it->second.data(), it->second.size(), it->first)) {
+				return false;
+			}
+			it = pages.erase(it);
+		}
+		return true;
+	}
+
+private:
+	std::map<sqlite3_int64, IdbBuffer> pages;
+	size_t max_pages;
+};
+
+/**
+ * Byte ranges modified since they were last stored.
+ * Ranges that overlap or touch each other are merged.
+ */
+class IdbDirtyRanges {
+public:
+	void add(sqlite3_int64 offset, sqlite3_int64 size) {
+		sqlite3_int64 start = offset;
+		sqlite3_int64 end = offset + size;
+		auto it = ranges.upper_bound(start);
+		if (it != ranges.begin() && std::prev(it)->second >= start) {
+			--it;
+		}
+		while (it != ranges.end() && it->first <= end) {
+			start = std::min(start, it->first);
+			end = std::max(end, it->second);
+			it = ranges.erase(it);
+		}
+		ranges[start] = end;
+	}
+
+	void truncate(sqlite3_int64 size) {
+		ranges.erase(ranges.lower_bound(size), ranges.end());
+		if (!ranges.empty()) {
+			auto last = std::prev(ranges.end());
+			last->second = std::min(last->second, size);
+		}
+	}
+
+	void clear() {
+		ranges.clear();
+	}
+
+	/// Ranges as a map from start to end offset
+	const std::map<sqlite3_int64, sqlite3_int64>& get() const {
+		return ranges;
+	}
+
+private:
+	std::map<sqlite3_int64, sqlite3_int64> ranges;
+};
+
+/**
+ * Shared memory locks held by a single connection, one bit per lock slot.
+ */
+struct IdbSharedMemoryLocks {
+	uint32_t shared = 0;
+	uint32_t exclusive = 0;
+};
+
+/**
+ * WAL index shared by all connections to a database in this process.
+ *
+ * IndexedDB has no notion of shared memory, and browsers run each database
+ * in a single process, so the WAL index is kept in heap memory. Its contents
+ * are rebuilt from the WAL file by SQLite whenever the first connection maps
+ * it, as if the process had restarted.
+ */
+class IdbSharedMemory {
+public:
+	static IdbSharedMemory *acquire(IdbBackend *backend, const char *dbname) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		IdbSharedMemory*& shm = registry[std::make_pair(backend, std::string(dbname))];
+		if (shm == nullptr) {
+			shm = new IdbSharedMemory(backend, dbname);
+		}
+		shm->refcount++;
+		return shm;
+	}
+
+	static void release(IdbSharedMemory *shm, IdbSharedMemoryLocks& locks) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		shm->unlock(~0u, locks);
+		if (--shm->refcount == 0) {
+			registry.erase(std::make_pair(shm->backend, shm->dbname));
+			delete shm;
+		}
+	}
+
+	int map(int region, int region_size, bool extend, void volatile **pp) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		if ((size_t) region >= regions.size()) {
+			if (!extend) {
+				*pp = nullptr;
+				return SQLITE_OK;
+			}
+			while ((size_t) region >= regions.size()) {
+				regions.emplace_back(new uint8_t[region_size]());
+			}
+		}
+		*pp = regions[region].get();
+		return SQLITE_OK;
+	}
+
+	int lock(int offset, int n, int flags, IdbSharedMemoryLocks& locks) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		uint32_t mask = ((1u << n) - 1) << offset;
+		if (flags & SQLITE_SHM_UNLOCK) {
+			unlock(mask, locks);
+			return SQLITE_OK;
+		}
+		else if (flags & SQLITE_SHM_SHARED) {
+			if ((locks.shared | locks.exclusive) & mask) {
+				return SQLITE_OK;
+			}
+			if (lock_state[offset] < 0) {
+				return SQLITE_BUSY;
+			}
+			lock_state[offset]++;
+			locks.shared |= mask;
+			return SQLITE_OK;
+		}
+		else {
+			for (int i = offset; i < offset + n; i++) {
+				if (lock_state[i] != 0 && !(locks.exclusive & (1u << i))) {
+					return SQLITE_BUSY;
+				}
+			}
+			for (int i = offset; i < offset + n; i++) {
+				lock_state[i] = -1;
+			}
+			locks.exclusive |= mask;
+			return SQLITE_OK;
+		}
+	}
+
+	void barrier() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+private:
+	IdbBackend *backend;
+	std::string dbname;
+	int refcount = 0;
+	std::vector<std::unique_ptr<uint8_t[]>> regions;
+	/// Number of shared locks held in each slot, or -1 if it is locked exclusively
+	int lock_state[SQLITE_SHM_NLOCK] = {};
+
+	static std::mutex registry_mutex;
+	static std::map<std::pair<IdbBackend *, std::string>, IdbSharedMemory *> registry;
+
+	IdbSharedMemory(IdbBackend *backend, const char *dbname)
+		: backend(backend)
+		, dbname(dbname)
+	{
+	}
+
+	void unlock(uint32_t mask, IdbSharedMemoryLocks& locks) {
+		for (int i = 0; i < SQLITE_SHM_NLOCK; i++) {
+			uint32_t bit = mask & (1u << i);
+			if (locks.exclusive & bit) {
+				lock_state[i] = 0;
+			}
+			else if (locks.shared & bit) {
+				lock_state[i]--;
+			}
+		}
+		locks.shared &= ~mask;
+		locks.exclusive &= ~mask;
+	}
+};
+
+std::mutex IdbSharedMemory::registry_mutex;
+std::map<std::pair<IdbBackend *, std::string>, IdbSharedMemory *> IdbSharedMemory::registry;
+
+/**
+ * Lock on a database file, shared by all of its connections in the process.
+ *
+ * Implements SQLite's SHARED, RESERVED, PENDING and EXCLUSIVE lock levels.
+ * Connections waiting for others to finish, like readers waiting for a writer
+ * or a writer waiting for readers to leave, block until the lock is released
+ * or their timeout expires, instead of polling from SQLite's busy handler.
+ * RESERVED locks never wait: their holder may itself be waiting for this
+ * connection's SHARED lock to be released.
+ */
+class IdbFileLock {
+public:
+	static IdbFileLock *acquire(IdbBackend *backend, const char *dbname) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		IdbFileLock*& lock = registry[std::make_pair(backend, std::string(dbname))];
+		if (lock == nullptr) {
+			lock = new IdbFileLock(backend, dbname);
+		}
+		lock->refcount++;
+		return lock;
+	}
+
+	static void release(IdbFileLock *lock, const void *owner, int& level) {
+		std::lock_guard<std::mutex> guard(registry_mutex);
+		lock->unlock(owner, level, SQLITE_LOCK_NONE);
+		if (--lock->refcount == 0) {
+			registry.erase(std::make_pair(lock->backend, lock->dbname));
+			delete lock;
+		}
+	}
+
+	/**
+	 * Raise the lock of `owner` to `new_level`, waiting up to `timeout_ms` for other connections.
+	 *
+	 * Unless `wait_for_readers` is set, EXCLUSIVE locks fail right away while other connections hold SHARED locks,
+	 * without taking PENDING in the meantime.
+	 */
+	int lock(const void *owner, int& level, int new_level, int timeout_ms, bool wait_for_readers = true) {
+		std::unique_lock<std::mutex> guard(mutex);
+		if (level >= new_level) {
+			return SQLITE_OK;
+		}
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		switch (new_level) {
+			case SQLITE_LOCK_SHARED:
+				// new readers wait for pending writers, so that these are not starved
+				if (!released.wait_until(guard, deadline, [this]() { return pending_owner == nullptr && exclusive_owner == nullptr; })) {
+					return SQLITE_BUSY;
+				}
+				shared_count++;
+				level = SQLITE_LOCK_SHARED;
+				return SQLITE_OK;
+
+			case SQLITE_LOCK_RESERVED:
+				if (reserved_owner || pending_owner || exclusive_owner) {
+					return SQLITE_BUSY;
+				}
+				reserved_owner = owner;
+				level = SQLITE_LOCK_RESERVED;
+				return SQLITE_OK;
+
+			default:
+				if (!wait_for_readers && shared_count > (level >= SQLITE_LOCK_SHARED ? 1 : 0)) {
+					return SQLITE_BUSY;
+				}
+				if (level < SQLITE_LOCK_PENDING) {
+					if (pending_owner || (reserved_owner && reserved_owner != owner)) {
+						return SQLITE_BUSY;
+					}
+					pending_owner = owner;
+					level = SQLITE_LOCK_PENDING;
+				}
+				// a failed attempt keeps the PENDING lock, SQLite retries or unlocks it later
+				if (!released.wait_until(guard, deadline, [this]() { return shared_count == 1; })) {
+					return SQLITE_BUSY;
+				}
+				exclusive_owner = owner;
+				level = SQLITE_LOCK_EXCLUSIVE;
+				return SQLITE_OK;
+		}
+	}
+
+	int unlock(const void *owner, int& level, int new_level) {
+		std::lock_guard<std::mutex> guard(mutex);
+		if (exclusive_owner == owner && new_level < SQLITE_LOCK_EXCLUSIVE) {
+			exclusive_owner = nullptr;
+		}
+		if (pending_owner == owner && new_level < SQLITE_LOCK_PENDING) {
+			pending_owner = nullptr;
+		}
+		if (reserved_owner == owner && new_level < SQLITE_LOCK_RESERVED) {
+			reserved_owner = nullptr;
+		}
+		if (level >= SQLITE_LOCK_SHARED && new_level < SQLITE_LOCK_SHARED) {
+			shared_count--;
+		}
+		level = new_level;
+		released.notify_all();
+		return SQLITE_OK;
+	}
+
+	bool is_reserved() {
+		std::lock_guard<std::mutex> guard(mutex);
+		return reserved_owner || pending_owner || exclusive_owner;
+	}
+
+	/// Whether the connection holding the write lock is in a write transaction, guarded by idbvfs_storage_mutex
+	bool in_write_transaction = false;
+
+	/// Whether the write transaction synced its journal or database, leaving the barrier to its end
+	bool barrier_deferred = false;
+
+	/// Whether the write transaction synced the database, which only happens when committing
+	bool database_synced = false;
+
+	/// Thread of the commit that synced the database
+	std::thread::id committing_thread;
+
+private:
+	IdbBackend *backend;
+	std::string dbname;
+	int refcount = 0;
+	std::mutex mutex;
+	std::condition_variable released;
+	int shared_count = 0;
+	const void *reserved_owner = nullptr;
+	const void *pending_owner = nullptr;
+	const void *exclusive_owner = nullptr;
+
+	static std::mutex registry_mutex;
+	static std::map<std::pair<IdbBackend *, std::string>, IdbFileLock *> registry;
+
+	IdbFileLock(IdbBackend *backend, const char *dbname)
+		: backend(backend)
+		, dbname(dbname)
+	{
+	}
+};
+
+std::mutex IdbFileLock::registry_mutex;
+std::map<std::pair<IdbBackend *, std::string>, IdbFileLock *> IdbFileLock::registry;
+
+/**
+ * Per connection configuration of idbvfs files.
+ */
+struct IdbFileOptions {
+	size_t page_cache_size = 0;
+	int pages_per_extent = 1;
+	size_t write_buffer_size = 0;
+	int lock_timeout = 0;
+	int durability = IDBVFS_DURABILITY;
+	std::chrono::milliseconds group_commit_interval{IDBVFS_GROUP_COMMIT_INTERVAL};
+	bool async_commit = IDBVFS_ASYNC_COMMIT;
+
+	static IdbFileOptions from_uri(sqlite3_filename file_name, bool is_db, int durability) {
+		IdbFileOptions options;
+		if (file_name) {
+			// journals and WAL files have the same URI parameters as their database
+			options.durability = std::min<sqlite3_int64>(std::max<sqlite3_int64>(IDBVFS_DURABILITY_OFF, sqlite3_uri_int64(file_name, IDBVFS_DURABILITY_PARAM, durability)), IDBVFS_DURABILITY_FULL);
+			options.async_commit = sqlite3_uri_boolean(file_name, IDBVFS_ASYNC_COMMIT_PARAM, IDBVFS_ASYNC_COMMIT);
+			options.group_commit_interval = std::chrono::milliseconds(std::max<sqlite3_int64>(0, sqlite3_uri_int64(file_name, IDBVFS_GROUP_COMMIT_INTERVAL_PARAM, IDBVFS_GROUP_COMMIT_INTERVAL)));
+		}
+		if (is_db) {
+			options.page_cache_size = sqlite3_uri_int64(file_name, IDBVFS_PAGE_CACHE_SIZE_PARAM, IDBVFS_PAGE_CACHE_SIZE);
+			options.pages_per_extent = std::max<sqlite3_int64>(1, sqlite3_uri_int64(file_name, IDBVFS_PAGES_PER_EXTENT_PARAM, IDBVFS_PAGES_PER_EXTENT));
+			options.write_buffer_size = sqlite3_uri_int64(file_name, IDBVFS_WRITE_BUFFER_SIZE_PARAM, IDBVFS_WRITE_BUFFER_SIZE);
+			options.lock_timeout = std::max<sqlite3_int64>(0, sqlite3_uri_int64(file_name, IDBVFS_LOCK_TIMEOUT_PARAM, IDBVFS_LOCK_TIMEOUT));
+		}
+		return options;
+	}
+};
+
+struct IdbFile : public SQLiteFileImpl {
+	sqlite3_filename file_name;
+	IdbBackend *backend;
+	IdbStorage *storage;
+	IdbStorage *wal_storage = nullptr;
+	IdbFileSize file_size;
+	IdbExtentSize extent_size;
+	IdbSharedPageCache *page_cache = nullptr;
+	IdbMappedPages mapped_pages;
+	IdbWriteBuffer write_buffer;
+	IdbWriteBuffer atomic_writes;
+	bool in_atomic_write = false;
+	IdbBuffer journal_data;
+	IdbDirtyRanges journal_dirty_ranges;
+	IdbBuffer temp_data;
+	IdbSharedMemory *shm = nullptr;
+	IdbSharedMemoryLocks shm_locks;
+	IdbFileLock *lock = nullptr;
+	IdbFileLock *database_lock = nullptr;
+	int lock_level = SQLITE_LOCK_NONE;
+	bool in_write_transaction = false;
+	int lock_timeout;
+	int durability;
+	std::chrono::milliseconds group_commit_interval;
+	bool async_commit;
+	uint64_t cache_generation = 0;
+	bool known_to_exist = false;
+	int pages_per_extent;
+	bool is_db;
+	bool is_wal;
+	bool is_temp;
+
+	IdbFile() {}
+	IdbFile(IdbBackend *backend, sqlite3_filename file_name, bool is_db, bool is_wal, bool is_temp, const IdbFileOptions& options = IdbFileOptions())
+		: file_name(file_name)
+		, backend(backend)
+		, storage(is_temp ? nullptr : acquireStorage(backend, file_name))
+		, file_size(storage, !is_temp && !is_db, is_wal)
+		, extent_size(storage)
+		, write_buffer(options.write_buffer_size)
+		, lock_timeout(options.lock_timeout)
+		, durability(options.durability)
+		, group_commit_interval(options.group_commit_interval)
+		, async_commit(options.async_commit)
+		, pages_per_extent(options.pages_per_extent)
+		, is_db(is_db)
+		, is_wal(is_wal)
+		, is_temp(is_temp)
+	{
+		if (is_db) {
+			lock = IdbFileLock::acquire(backend, file_name);
+			page_cache = IdbSharedPageCache::acquire(backend, file_name, options.page_cache_size);
+			cache_generation = changeLogGeneration();
+			loadDbSize();
+		}
+		else if (!is_temp && !is_wal) {
+			database_lock = acquireDatabaseLock(backend, file_name);
+		}
+	}
+
+	int iVersion() const override {
+		return 3;
+	}
+
+	int xClose() override {
+		if (is_temp) {
+			temp_data.clear();
+			return SQLITE_OK;
+		}
+		if (shm) {
+			xShmUnmap(false);
+		}
+		// buffered writes are part of the file contents, even if SQLite never synced them
+		if (!write_buffer.empty()) {
+			flushWriteBuffer();
+			file_size.sync();
+		}
+		// WAL frames are stored as they are written, only their size may be pending
+		if (is_wal) {
+			file_size.sync();
+			file_size.release();
+		}
+		setWriteTransaction(false);
+		if (lock) {
+			IdbFileLock::release(lock, this, lock_level);
+			lock = nullptr;
+		}
+		if (database_lock) {
+			int database_lock_level = SQLITE_LOCK_NONE;
+			IdbFileLock::release(database_lock, this, database_lock_level);
+			database_lock = nullptr;
+		}
+		if (page_cache) {
+			IdbSharedPageCache::release(page_cache);
+			page_cache = nullptr;
+		}
+		std::unique_ptr<IdbFlushTask> barrier;
+		{
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			// syncs left without a barrier are persisted when closing, journals are not needed past their transaction
+			if ((is_db || is_wal) && storage->group_commit.pending()) {
+				barrier = beginBarrier(SQLITE_SYNC_NORMAL);
+			}
+			backend->release(wal_storage);
+			backend->release(storage);
+		}
+		wal_storage = nullptr;
+		storage = nullptr;
+		completeBarrier(std::move(barrier));
+		return SQLITE_OK;
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		TRACE_LOG("READ %s %d @ %ld", file_name, iAmt, iOfst);
+		if (is_temp) {
+			int result = readTemp(p, iAmt, iOfst);
+			TRACE_LOG("  > %d", result);
+			return result;
+		}
+		if (is_wal) {
+			// WAL files are read directly from storage, which is shared by all connections
+			int result = readWal(p, iAmt, iOfst);
+			TRACE_LOG("  > %d", result);
+			return result;
+		}
+		sqlite3_int64 size = file_size.get();
+		if (is_db && shm && iAmt + iOfst > size) {
+			// checkpoints may store pages past the size in the database header, which SQLite
+			// updates only once the pages changed after them are checkpointed as well
+			int result = readDb(p, iAmt, iOfst);
+			TRACE_LOG("  > %d", result);
+			return result;
+		}
+		if (iAmt + iOfst > size) {
+			// read what is available and zero-fill the rest, as SQLite expects from short reads
+			int available_bytes = iOfst < size ? size - iOfst : 0;
+			memset((uint8_t *) p + available_bytes, 0, iAmt - available_bytes);
+			if (available_bytes > 0) {
+				is_db ? readDb(p, available_bytes, iOfst) : readJournal(p, available_bytes, iOfst);
+			}
+			TRACE_LOG("  > %d", false);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+
+		int result;
+		if (is_db) {
+			result = readDb(p, iAmt, iOfst);
+		}
+		else {
+			result = readJournal(p, iAmt, iOfst);
+		}
+		TRACE_LOG("  > %d", result);
+		return result;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		TRACE_LOG("WRITE %s %d @ %ld", file_name, iAmt, iOfst);
+		int result;
+		if (is_db && shm && !persistLog()) {
+			result = SQLITE_IOERR_WRITE;
+		}
+		else if (is_db) {
+			result = writeDb(p, iAmt, iOfst);
+		}
+		else if (is_wal) {
+			result = writeWal(p, iAmt, iOfst);
+		}
+		else if (is_temp) {
+			result = writeTemp(p, iAmt, iOfst);
+		}
+		else {
+			result = writeJournal(p, iAmt, iOfst);
+		}
+		TRACE_LOG("  > %d", result);
+		return result;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		TRACE_LOG("TRUNCATE %s to %ld", file_name, size);
+		if (is_db) {
+			truncateDb(size);
+		}
+		else if (is_wal) {
+			truncateWal(size);
+		}
+		else if (is_temp) {
+			if ((sqlite3_int64) temp_data.size() > size) {
+				temp_data.resize(size);
+			}
+		}
+		else {
+			truncateJournal(size);
+		}
+		TRACE_LOG("  > %d", true);
+		return SQLITE_OK;
+	}
+
+	int xSync(int flags) override {
+		TRACE_LOG("SYNC %s %d", file_name, flags);
+		if (is_temp) {
+			// temporary files are never persisted
+			return SQLITE_OK;
+		}
+		if (!flushWriteBuffer()) {
+			TRACE_LOG("  > %d", false);
+			return SQLITE_IOERR_FSYNC;
+		}
+		// journal data is kept in memory, only ranges written since the last sync are stored
+		if (!journal_dirty_ranges.get().empty()) {
+			if (!flushJournal()) {
+				TRACE_LOG("  > %d", false);
+				return SQLITE_IOERR_FSYNC;
+			}
+			file_size.set(journal_data.size());
+			// once stored, the journal is reloaded if needed again
+			if (idbvfs_memory.exceeded()) {
+				journal_data.clear();
+			}
+		}
+		bool success = file_size.sync() && syncStorage(flags);
+		TRACE_LOG("  > %d", success);
+		return success ? SQLITE_OK : SQLITE_IOERR_FSYNC;
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		TRACE_LOG("FILE SIZE %s", file_name);
+		if (is_temp) {
+			*pSize = temp_data.size();
+		}
+		else if (!journal_data.empty()) {
+			*pSize = journal_data.size();
+		}
+		else {
+			*pSize = file_size.get();
+		}
+		TRACE_LOG("  > %d", *pSize);
+		return SQLITE_OK;
+	}
+
+	int xLock(int flags) override {
+		TRACE_LOG("LOCK %s %d -> %d", file_name, lock_level, flags);
+		if (!lock) {
+			lock_level = flags;
+			return SQLITE_OK;
+		}
+		int previous_level = lock_level;
+		// in WAL mode, EXCLUSIVE is only asked for opportunistically, like when closing, and readers never go away on their own
+		int result = lock->lock(this, lock_level, flags, lock_timeout, shm == nullptr);
+		// read transactions in rollback journal modes start by taking a shared lock
+		if (result == SQLITE_OK && previous_level == SQLITE_LOCK_NONE) {
+			validateCaches();
+		}
+		if (result == SQLITE_OK && lock_level >= SQLITE_LOCK_RESERVED) {
+			setWriteTransaction(true);
+		}
+		TRACE_LOG("  > %d", result);
+		return result;
+	}
+
+	int xUnlock(int flags) override {
+		// other connections read the file once the write transaction ends, even if SQLite never synced it
+		if (lock_level >= SQLITE_LOCK_RESERVED && flags < SQLITE_LOCK_RESERVED) {
+			if (!flushWriteBuffer() || !file_size.sync()) {
+				return SQLITE_IOERR_UNLOCK;
+			}
+		}
+		if (!lock) {
+			lock_level = flags;
+			return SQLITE_OK;
+		}
+		int result = lock->unlock(this, lock_level, flags);
+		if (lock_level < SQLITE_LOCK_RESERVED) {
+			setWriteTransaction(false);
+		}
+		return result;
+	}
+
+	int xCheckReservedLock(int *pResOut) override {
+		*pResOut = lock && lock->is_reserved();
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		switch (op) {
+			case SQLITE_FCNTL_VFSNAME:
+				*(char **) pArg = sqlite3_mprintf("%z", IDBVFS_NAME);
+				return SQLITE_OK;
+
+			case SQLITE_FCNTL_MMAP_SIZE: {
+				// report the previous limit, and set the new one unless it is negative
+				sqlite3_int64 new_limit = *(sqlite3_int64 *) pArg;
+				*(sqlite3_int64 *) pArg = mapped_pages.get_limit();
+				if (new_limit >= 0 && is_db) {
+					mapped_pages.set_limit(new_limit);
+				}
+				return SQLITE_OK;
+			}
+
+			// writes between BEGIN and COMMIT are staged in memory and stored all at once,
+			// which is atomic because nothing is persisted until the next flush
+			case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+				TRACE_LOG("BEGIN ATOMIC WRITE %s", file_name);
+				in_atomic_write = true;
+				return SQLITE_OK;
+
+			case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE: {
+				TRACE_LOG("COMMIT ATOMIC WRITE %s", file_name);
+				in_atomic_write = false;
+				bool success = atomic_writes.flush([this](const void *data, size_t data_size, sqlite3_int64 offset) {
+					return writeDb(data, data_size, offset) == SQLITE_OK;
+				});
+				TRACE_LOG("  > %d", success);
+				return success ? SQLITE_OK : SQLITE_IOERR_COMMIT_ATOMIC;
+			}
+
+			case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+				TRACE_LOG("ROLLBACK ATOMIC WRITE %s", file_name);
+				in_atomic_write = false;
+				atomic_writes.clear();
+				return SQLITE_OK;
+
+			// sent once the journal is finalized, which also happens in exclusive locking mode, where locks are kept
+			case SQLITE_FCNTL_COMMIT_PHASETWO:
+				TRACE_LOG("COMMIT PHASE TWO %s", file_name);
+				return setWriteTransaction(false) ? SQLITE_OK : SQLITE_IOERR_FSYNC;
+		}
+		return SQLITE_NOTFOUND;
+	}
+
+	int xSectorSize() override {
+		return DISK_SECTOR_SIZE;
+	}
+
+	int xDeviceCharacteristics() override {
+		if (is_db && storage->atomic_flush()) {
+			return SQLITE_IOCAP_BATCH_ATOMIC;
+		}
+		return 0;
+	}
+
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		TRACE_LOG("FETCH %s %d @ %ld", file_name, iAmt, iOfst);
+		*pp = nullptr;
+		if (!is_db || !mapped_pages.covers(iOfst, iAmt) || iOfst + iAmt > (sqlite3_int64) file_size.get()) {
+			// SQLite reads the page with xRead instead
+			return SQLITE_OK;
+		}
+		uint8_t *data = mapped_pages.acquire(iOfst, iAmt);
+		if (data == nullptr && !idbvfs_memory.exceeded()) {
+			IdbBuffer page;
+			page.resize(iAmt);
+			if (readDb(page.data(), iAmt, iOfst, false) != SQLITE_OK) {
+				return SQLITE_OK;
+			}
+			data = mapped_pages.acquire(iOfst, page);
+		}
+		if (data) {
+			idbvfs_global_stats.pages_fetched++;
+		}
+		*pp = data;
+		return SQLITE_OK;
+	}
+
+	int xUnfetch(sqlite3_int64 iOfst, void *p) override {
+		if (p) {
+			mapped_pages.release(iOfst);
+		}
+		else {
+			// SQLite wants the whole mapping released, keep only pages it still references
+			mapped_pages.remove_unused(0, INT64_MAX);
+		}
+		return SQLITE_OK;
+	}
+
+	int xShmMap(int iPg, int pgsz, int bExtend, void volatile **pp) override {
+		if (shm == nullptr) {
+			shm = IdbSharedMemory::acquire(backend, file_name);
+		}
+		return shm->map(iPg, pgsz, bExtend, pp);
+	}
+
+	int xShmLock(int offset, int n, int flags) override {
+		TRACE_LOG("SHM LOCK %s %d %d %d", file_name, offset, n, flags);
+		int result = shm->lock(offset, n, flags, shm_locks);
+		// read transactions in WAL mode start by taking a shared read mark lock,
+		// while the shared lock on the database file is held for the whole connection
+		if (result == SQLITE_OK && flags == (SQLITE_SHM_LOCK | SQLITE_SHM_SHARED) && offset >= IDBVFS_WAL_READ_LOCK) {
+			validateCaches();
+		}
+		TRACE_LOG("  > %d", result);
+		return result;
+	}
+
+	void xShmBarrier() override {
+		if (shm) {
+			shm->barrier();
+		}
+	}
+
+	int xShmUnmap(int deleteFlag) override {
+		if (shm) {
+			// memory is freed when the last connection unmaps it, so there is nothing to delete
+			IdbSharedMemory::release(shm, shm_locks);
+			shm = nullptr;
+		}
+		return SQLITE_OK;
+	}
+
+private:
+	int readDb(void *p, int iAmt, sqlite3_int64 iOfst, bool cache_result = true) {
+		if (atomic_writes.read(p, iAmt, iOfst)) {
+			return SQLITE_OK;
+		}
+		if (mapped_pages.read(p, iAmt, iOfst)) {
+			return SQLITE_OK;
+		}
+		if (page_cache->read(p, iAmt, iOfst)) {
+			return SQLITE_OK;
+		}
+		if (write_buffer.read(p, iAmt, iOfst)) {
+			return SQLITE_OK;
+		}
+		// ranges partially buffered are read after storing pending writes
+		if (write_buffer.overlaps(iOfst, iAmt) && !flushWriteBuffer()) {
+			return SQLITE_IOERR_READ;
+		}
+
+		sqlite3_int64 extent_bytes = get_extent_size(iAmt, iOfst);
+		if (extent_bytes <= 0) {
+			return SQLITE_IOERR_READ;
+		}
+
+		// ranges may span several extents, e.g. after the page size changed
+		size_t loaded_bytes = loadExtents(p, iAmt, iOfst, extent_bytes);
+		if (loaded_bytes < (size_t) iAmt) {
+			memset((uint8_t *) p + loaded_bytes, 0, iAmt - loaded_bytes);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+
+		// mapped pages are not duplicated in the page cache
+		if (!cache_result) {
+			return SQLITE_OK;
+		}
+		else if (mapped_pages.covers(iOfst, iAmt)) {
+			mapped_pages.store(p, iAmt, iOfst);
+		}
+		else {
+			page_cache->store(p, iAmt, iOfst);
+		}
+		return SQLITE_OK;
+	}
+
+	void loadJournal() {
+		size_t journal_size = file_size.get();
+		if (journal_data.empty() && journal_size > 0) {
+			journal_data.resize(journal_size);
+			if (loadExtents(journal_data.data(), journal_size, 0, IDBVFS_JOURNAL_SEGMENT_SIZE) < journal_size) {
+				// journals stored by older versions are a single object
+				IdbPage(storage, 0).load_into(journal_data.data(), journal_size);
+			}
+		}
+	}
+
+	int readJournal(void *p, int iAmt, sqlite3_int64 iOfst) {
+		loadJournal();
+		if (iAmt + iOfst > (sqlite3_int64) journal_data.size()) {
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		memcpy(p, journal_data.data() + iOfst, iAmt);
+		return SQLITE_OK;
+	}
+
+	int readWal(void *p, int iAmt, sqlite3_int64 iOfst) {
+		size_t loaded_bytes = loadExtents(p, iAmt, iOfst, IDBVFS_JOURNAL_SEGMENT_SIZE);
+		if (loaded_bytes < (size_t) iAmt) {
+			memset((uint8_t *) p + loaded_bytes, 0, iAmt - loaded_bytes);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
 	}
 
-	int load_into(void *data, size_t data_size, sqlite3_int64 offset_in_page = 0) const {
-		if (FILE *f = fopen(filename.c_str(), "r")) {
-			if (offset_in_page > 0) {
-				fseek(f, offset_in_page, SEEK_SET);
+	int writeDb(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		if (in_atomic_write) {
+			// failing makes SQLite roll back the batch and use a journal instead
+			if (atomic_writes.overlaps(iOfst, iAmt, true)) {
+				return SQLITE_IOERR_WRITE;
 			}
-			size_t read_bytes = fread(data, 1, data_size, f);
-			fclose(f);
-			return read_bytes;
+			atomic_writes.write(p, iAmt, iOfst);
+			return SQLITE_OK;
+		}
+		if (write_buffer.enabled()) {
+			if ((write_buffer.full() || idbvfs_memory.exceeded() || write_buffer.overlaps(iOfst, iAmt, true)) && !flushWriteBuffer()) {
+				return SQLITE_IOERR_WRITE;
+			}
+			write_buffer.write(p, iAmt, iOfst);
+		}
+		else if (!storeDb(p, iAmt, iOfst)) {
+			page_cache->invalidate(iOfst, iAmt);
+			return SQLITE_IOERR_WRITE;
+		}
+		// mapped pages are not duplicated in the page cache
+		if (mapped_pages.covers(iOfst, iAmt)) {
+			page_cache->invalidate(iOfst, iAmt);
 		}
 		else {
-			return 0;
+			page_cache->store(p, iAmt, iOfst);
+		}
+		mapped_pages.store(p, iAmt, iOfst);
+
+		file_size.update_if_greater(iAmt + iOfst);
+		if (iOfst == 0) {
+			file_size.set_derived(sizeFromHeader(p, iAmt) > 0);
 		}
+		recordChange(iOfst, iAmt);
+		return SQLITE_OK;
 	}
 
-	int load_into(std::vector<uint8_t>& out_buffer, size_t data_size) const {
-		out_buffer.resize(data_size);
-		return load_into(out_buffer.data(), data_size);
+	static IdbStorage *acquireStorage(IdbBackend *backend, const char *file_name) {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		return backend->acquire(file_name);
 	}
 
-	int scan_into(const char *fmt, ...) const {
-		if (FILE *f = fopen(filename.c_str(), "r")) {
-			va_list args;
-			va_start(args, fmt);
-			int assigned_items = vfscanf(f, fmt, args);
-			va_end(args);
-			fclose(f);
-			return assigned_items;
-		}
-		else {
-			return 0;
+	/**
+	 * Get the lock of the database a rollback journal belongs to, whose write transaction its syncs are part of.
+	 *
+	 * Super-journals, which list the journals of a commit to several databases, belong to none of them.
+	 */
+	static IdbFileLock *acquireDatabaseLock(IdbBackend *backend, const char *file_name) {
+		static const char suffix[] = "-journal";
+		size_t name_length = strlen(file_name);
+		if (name_length < sizeof(suffix) || strcmp(file_name + name_length - (sizeof(suffix) - 1), suffix) != 0) {
+			return nullptr;
 		}
+		return IdbFileLock::acquire(backend, std::string(file_name, name_length - (sizeof(suffix) - 1)).c_str());
 	}
 
-	int store(const void *data, size_t data_size) const {
-		mkdir(dbname, 0777);
+	bool syncStorage(int flags) {
+		std::unique_ptr<IdbFlushTask> barrier;
+		{
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			switch (durability) {
+				case IDBVFS_DURABILITY_OFF:
+					storage->group_commit.defer();
+					return true;
 
-		if (FILE *f = fopen(filename.c_str(), "w")) {
-			size_t written_bytes = fwrite(data, 1, data_size, f);
-			fclose(f);
-			return written_bytes;
-		}
-		else {
-			return 0;
+				case IDBVFS_DURABILITY_NORMAL:
+					// storages that persist files one by one keep the barriers SQLite orders its writes with,
+					// only WAL commits can be grouped, as with PRAGMA synchronous=NORMAL
+					if ((storage->atomic_flush() || is_wal) && !storage->group_commit.sync_is_due(group_commit_interval)) {
+						if (idbvfs_group_commits.insert(storage).second) {
+							idbvfs_flusher.schedule(storage->group_commit.time_until_due(), flush_group_commits);
+						}
+						return true;
+					}
+					break;
+			}
+			// atomic barriers persist all storages of the backend, so a single barrier at the end of the write
+			// transaction covers the journal and database synced by a commit, and those of attached databases
+			IdbFileLock *transaction_lock = is_db ? lock : database_lock;
+			if (storage->atomic_flush() && transaction_lock && transaction_lock->in_write_transaction) {
+				transaction_lock->barrier_deferred = true;
+				if (is_db && !transaction_lock->database_synced) {
+					transaction_lock->database_synced = true;
+					transaction_lock->committing_thread = std::this_thread::get_id();
+					backend->committing_databases[transaction_lock->committing_thread]++;
+				}
+				return true;
+			}
+			barrier = beginBarrier(flags);
 		}
+		return completeBarrier(std::move(barrier));
 	}
 
-	int store(const std::vector<uint8_t>& data) const {
-		return store(data.data(), data.size());
-	}
-
-	int store(const std::string& data) const {
-		return store(data.c_str(), data.size());
+	/**
+	 * Enter or leave a write transaction, making the barrier its syncs deferred when it ends.
+	 *
+	 * Databases committed together by a connection are synced before any of their transactions ends, so these
+	 * leave their barrier to the last database synced by the commit on their thread. Other write transactions,
+	 * even on the same thread, never hold back a commit's barrier.
+	 */
+	bool setWriteTransaction(bool active) {
+		if (!is_db || active == in_write_transaction) {
+			return true;
+		}
+		std::unique_ptr<IdbFlushTask> barrier;
+		{
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			in_write_transaction = active;
+			lock->in_write_transaction = active;
+			if (active || !lock->barrier_deferred) {
+				return true;
+			}
+			lock->barrier_deferred = false;
+			if (lock->database_synced) {
+				lock->database_synced = false;
+				auto committing = backend->committing_databases.find(lock->committing_thread);
+				if (--committing->second > 0) {
+					return true;
+				}
+				backend->committing_databases.erase(committing);
+			}
+			barrier = beginBarrier(SQLITE_SYNC_NORMAL);
+		}
+		return completeBarrier(std::move(barrier));
 	}
 
-	bool remove() const {
-		return unlink(filename.c_str()) == 0;
+	/**
+	 * Make the WAL durable before checkpointing its frames into the database, on storages that persist files
+	 * one by one: WAL syncs grouped by the NORMAL durability level may still be waiting for their barrier,
+	 * and with asynchronous commits the background flusher may not have completed it yet.
+	 */
+	bool persistLog() {
+		std::unique_ptr<IdbFlushTask> barrier;
+		uint64_t pending_barrier;
+		{
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			if (storage->atomic_flush()) {
+				return true;
+			}
+			if (wal_storage == nullptr) {
+				wal_storage = backend->acquire((std::string(file_name) + "-wal").c_str());
+			}
+			if (wal_storage->group_commit.pending()) {
+				wal_storage->group_commit.barrier_done();
+				barrier = wal_storage->begin_flush(SQLITE_SYNC_NORMAL);
+			}
+			pending_barrier = wal_storage->pending_barrier;
+		}
+		if (!completeBarrier(std::move(barrier))) {
+			return false;
+		}
+		return pending_barrier == 0 || idbvfs_flusher.wait(pending_barrier, -1) == SQLITE_OK;
 	}
 
-private:
-	const char *dbname;
-	std::string filename;
-};
-
-struct IdbFileSize : public IdbPage {
-	IdbFileSize() : IdbPage() {}
-	IdbFileSize(sqlite3_filename file_name, bool autoload = true) : IdbPage(file_name, IDBVFS_SIZE_KEY) {
-		if (autoload) {
-			load();
+	/**
+	 * Start a persistence barrier for the storage, which must be locked.
+	 *
+	 * @return Work left to complete the barrier, to run with `completeBarrier` once the storage is unlocked,
+	 *         or nullptr if the background flusher completes it, with asynchronous commits.
+	 */
+	std::unique_ptr<IdbFlushTask> beginBarrier(int flags) {
+		storage->group_commit.barrier_done();
+		std::unique_ptr<IdbFlushTask> task = storage->begin_flush(flags);
+		// on storages that persist files one by one, SQLite overwrites the database right after syncing its journal
+		// and deletes the journal right after syncing the database, so only WAL barriers may complete later
+		if (async_commit && (storage->atomic_flush() || is_wal)) {
+			storage->pending_barrier = idbvfs_flusher.enqueue(std::move(task));
+			return nullptr;
 		}
+		return task;
 	}
 
-	void load() {
-		scan_into("%lu", &file_size);
-		is_dirty = false;
+	/**
+	 * Complete a barrier started with `beginBarrier`, without holding the storage mutex,
+	 * so that syncing files does not block connections to other databases.
+	 */
+	static bool completeBarrier(std::unique_ptr<IdbFlushTask> task) {
+		return task == nullptr || task->run();
 	}
 
-	size_t get() const {
-		return file_size;
+	uint64_t changeLogGeneration() {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		return storage->change_log.generation();
 	}
 
-	void set(size_t new_file_size) {
-		if (new_file_size != file_size) {
-			file_size = new_file_size;
-			is_dirty = true;
+	/**
+	 * Record a write made by this connection, whose own caches are already up to date.
+	 */
+	void recordChange(sqlite3_int64 offset, sqlite3_int64 size) {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		uint64_t generation = storage->change_log.record(offset, size);
+		if (cache_generation + 1 == generation) {
+			cache_generation = generation;
 		}
 	}
 
-	void update_if_greater(size_t new_file_size) {
-		if (new_file_size > file_size) {
-			set(new_file_size);
+	/**
+	 * Invalidate mapped ranges written by other connections since the last transaction.
+	 */
+	void validateCaches() {
+		{
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			uint64_t generation = storage->change_log.generation();
+			if (generation == cache_generation) {
+				return;
+			}
+			// the page cache is shared with the connection that made the changes, only mapped pages are outdated
+			bool complete = storage->change_log.changes_since(cache_generation, [this](sqlite3_int64 offset, sqlite3_int64 size) {
+				mapped_pages.remove_unused(offset, offset + size);
+			});
+			if (!complete) {
+				mapped_pages.remove_unused(0, INT64_MAX);
+			}
+			cache_generation = generation;
 		}
-	}
 
-	bool sync() const {
-		if (is_dirty) {
-			return store(std::to_string(file_size)) > 0;
+		// the database may have been resized
+		uint8_t header[100];
+		sqlite3_int64 size = 0;
+		if (readDb(header, sizeof(header), 0) == SQLITE_OK) {
+			size = sizeFromHeader(header, sizeof(header));
+		}
+		if (size > 0) {
+			file_size.set(size);
+			file_size.set_derived(true);
 		}
 		else {
-			return true;
+			file_size.set_derived(false);
+			file_size.load();
 		}
 	}
 
-private:
-	size_t file_size = 0;
-	bool is_dirty = false;
-};
-
-struct IdbFile : public SQLiteFileImpl {
-	sqlite3_filename file_name;
-	IdbFileSize file_size;
-	std::vector<uint8_t> journal_data;
-	bool is_db;
-
-	IdbFile() {}
-	IdbFile(sqlite3_filename file_name, bool is_db) : file_name(file_name), file_size(file_name), is_db(is_db) {}
-
-	int iVersion() const override {
-		return 1;
-	}
+	bool storeDb(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		// first write to a new database defines its extent size
+		if (extent_size.get() == 0 && !extent_size.init((sqlite3_int64) pages_per_extent * iAmt)) {
+			return false;
+		}
 
-	int xClose() override {
-		return SQLITE_OK;
+		return storeExtents(p, iAmt, iOfst, get_extent_size(iAmt, iOfst));
 	}
 
-	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
-		TRACE_LOG("READ %s %d @ %ld", file_name, iAmt, iOfst);
-		if (iAmt + iOfst > file_size.get()) {
-			TRACE_LOG("  > %d", false);
-			return SQLITE_IOERR_SHORT_READ;
+	/**
+	 * Load `data_size` bytes at `offset`, from objects of `extent_bytes` bytes each.
+	 *
+	 * @return Number of bytes loaded, which is less than `data_size` if some object is missing or short.
+	 */
+	size_t loadExtents(void *p, size_t data_size, sqlite3_int64 offset, sqlite3_int64 extent_bytes) {
+		uint8_t *data = (uint8_t *) p;
+		size_t loaded_bytes = 0;
+		while (loaded_bytes < data_size) {
+			sqlite3_int64 offset_in_extent = offset % extent_bytes;
+			size_t chunk_size = std::min<sqlite3_int64>(data_size - loaded_bytes, extent_bytes - offset_in_extent);
+			IdbPage extent(storage, offset / extent_bytes);
+			size_t chunk_loaded_bytes = extent.load_into(data + loaded_bytes, chunk_size, offset_in_extent);
+			loaded_bytes += chunk_loaded_bytes;
+			if (chunk_loaded_bytes < chunk_size) {
+				break;
+			}
+			offset += chunk_size;
 		}
+		return loaded_bytes;
+	}
 
-		int result;
-		if (is_db) {
-			result = readDb(p, iAmt, iOfst);
+	/**
+	 * Store `data_size` bytes at `offset`, into objects of `extent_bytes` bytes each.
+	 */
+	bool storeExtents(const void *p, size_t data_size, sqlite3_int64 offset, sqlite3_int64 extent_bytes) {
+		const uint8_t *data = (const uint8_t *) p;
+		size_t stored_bytes = 0;
+		while (stored_bytes < data_size) {
+			sqlite3_int64 offset_in_extent = offset % extent_bytes;
+			size_t chunk_size = std::min<sqlite3_int64>(data_size - stored_bytes, extent_bytes - offset_in_extent);
+			IdbPage extent(storage, offset / extent_bytes);
+			if (extent.store_at(data + stored_bytes, chunk_size, offset_in_extent) < (int) chunk_size) {
+				return false;
+			}
+			stored_bytes += chunk_size;
+			offset += chunk_size;
 		}
-		else {
-			result = readJournal(p, iAmt, iOfst);
+		if (!known_to_exist) {
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			backend->known_files.set(file_name, true);
+			known_to_exist = true;
 		}
-		TRACE_LOG("  > %d", result);
-		return result;
+		return true;
 	}
 
-	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
-		TRACE_LOG("WRITE %s %d @ %ld", file_name, iAmt, iOfst);
-		int result;
-		if (is_db) {
-			result = writeDb(p, iAmt, iOfst);
+	/**
+	 * Remove or shrink the objects of `extent_bytes` bytes each past `size`, up to `old_size`.
+	 */
+	void truncateExtents(sqlite3_int64 size, sqlite3_int64 old_size, sqlite3_int64 extent_bytes) {
+		sqlite3_int64 first_unused_extent = (size + extent_bytes - 1) / extent_bytes;
+		sqlite3_int64 last_extent = (old_size - 1) / extent_bytes;
+		for (sqlite3_int64 i = first_unused_extent; i <= last_extent; i++) {
+			IdbPage(storage, i).remove();
 		}
-		else {
-			result = writeJournal(p, iAmt, iOfst);
+		if (size % extent_bytes != 0) {
+			IdbPage(storage, size / extent_bytes).truncate(size % extent_bytes);
 		}
-		TRACE_LOG("  > %d", result);
-		return result;
 	}
 
-	int xTruncate(sqlite3_int64 size) override {
-		TRACE_LOG("TRUNCATE %s to %ld", file_name, size);
-		file_size.set(size);
-		TRACE_LOG("  > %d", true);
-		return SQLITE_OK;
+	bool flushJournal() {
+		for (auto& range : journal_dirty_ranges.get()) {
+			size_t range_size = range.second - range.first;
+			if (!storeExtents(journal_data.data() + range.first, range_size, range.first, IDBVFS_JOURNAL_SEGMENT_SIZE)) {
+				return false;
+			}
+			idbvfs_global_stats.journal_bytes_written += range_size;
+		}
+		journal_dirty_ranges.clear();
+		return true;
 	}
 
-	int xSync(int flags) override {
-		TRACE_LOG("SYNC %s %d", file_name, flags);
-		// journal data is stored in-memory and synced all at once
-		if (!journal_data.empty()) {
-			IdbPage file(file_name, 0);
-			file.store(journal_data);
-			file_size.set(journal_data.size());
-		}
-		bool success = file_size.sync();
-		INLINE_JS({
-			Module.idbvfsSyncfs();
+	bool flushWriteBuffer() {
+		return write_buffer.flush([this](const void *data, size_t data_size, sqlite3_int64 offset) {
+			TRACE_LOG("  FLUSH %s %d @ %ld", file_name, data_size, offset);
+			return storeDb(data, data_size, offset);
 		});
-		TRACE_LOG("  > %d", success);
-		return success ? SQLITE_OK : SQLITE_IOERR_FSYNC;
 	}
 
-	int xFileSize(sqlite3_int64 *pSize) override {
-		TRACE_LOG("FILE SIZE %s", file_name);
-		if (!journal_data.empty()) {
-			*pSize = journal_data.size();
+	/**
+	 * Get the size of database extents.
+	 * The database header is always inside the first extent, even before its size is known.
+	 */
+	sqlite3_int64 get_extent_size(int iAmt, sqlite3_int64 iOfst) {
+		sqlite3_int64 extent_bytes = extent_size.get();
+		if (extent_bytes <= 0 && iOfst + iAmt <= 512) {
+			return 512;
 		}
-		else {
-			*pSize = file_size.get();
-		}
-		TRACE_LOG("  > %d", *pSize);
-		return SQLITE_OK;
+		return extent_bytes;
 	}
 
-	int xLock(int flags) override {
-		return SQLITE_OK;
+	/**
+	 * Get the database size from the page count and page size in its header.
+	 *
+	 * @return Size in bytes, or 0 if the header is missing or its page count is not valid.
+	 */
+	static sqlite3_int64 sizeFromHeader(const void *data, size_t data_size) {
+		const uint8_t *header = (const uint8_t *) data;
+		if (data_size < 100 || memcmp(header, "SQLite format 3", 16) != 0) {
+			return 0;
+		}
+		// the page count is only valid if "version-valid-for" matches the change counter
+		if (memcmp(header + 24, header + 92, 4) != 0) {
+			return 0;
+		}
+		sqlite3_int64 page_size = (header[16] << 8) | header[17];
+		if (page_size == 1) {
+			page_size = 65536;
+		}
+		sqlite3_int64 page_count = ((sqlite3_int64) header[28] << 24) | (header[29] << 16) | (header[30] << 8) | header[31];
+		return page_size * page_count;
 	}
 
-	int xUnlock(int flags) override {
-		return SQLITE_OK;
+	void loadDbSize() {
+		// the stored size is used only when the header does not know it, e.g. for new databases
+		uint8_t header[100];
+		bool cached = page_cache->read(header, sizeof(header), 0);
+		int header_size = cached ? sizeof(header) : IdbPage(storage, 0).load_into(header, sizeof(header));
+		sqlite3_int64 size = sizeFromHeader(header, header_size);
+		if (size > 0) {
+			file_size.set(size);
+			file_size.set_derived(true);
+			// SQLite starts by reading the header, spare it from loading again
+			if (!cached) {
+				page_cache->store(header, sizeof(header), 0);
+			}
+		}
+		else {
+			file_size.load();
+		}
 	}
 
-	int xCheckReservedLock(int *pResOut) override {
-		*pResOut = 0;
-		return SQLITE_OK;
-	}
+	void truncateDb(sqlite3_int64 size) {
+		sqlite3_int64 old_size = file_size.get();
+		file_size.set(size);
+		if (size < 100) {
+			file_size.set_derived(false);
+		}
+		recordChange(size, INT64_MAX - size);
+		page_cache->truncate(size);
+		mapped_pages.truncate(size);
+		write_buffer.truncate(size);
 
-	int xFileControl(int op, void *pArg) override {
-		switch (op) {
-			case SQLITE_FCNTL_VFSNAME:
-				*(char **) pArg = sqlite3_mprintf("%z", IDBVFS_NAME);
-				return SQLITE_OK;
+		sqlite3_int64 extent_bytes = extent_size.get();
+		if (extent_bytes > 0 && size < old_size) {
+			// reclaim storage of extents past the new end of file
+			truncateExtents(size, old_size, extent_bytes);
 		}
-		return SQLITE_NOTFOUND;
 	}
 
-	int xSectorSize() override {
-		return DISK_SECTOR_SIZE;
+	void truncateJournal(sqlite3_int64 size) {
+		sqlite3_int64 old_size = std::max<sqlite3_int64>(file_size.get(), journal_data.size());
+		if ((sqlite3_int64) journal_data.size() > size) {
+			journal_data.resize(size);
+		}
+		journal_dirty_ranges.truncate(size);
+		file_size.set(size);
+		if (size < old_size) {
+			truncateExtents(size, old_size, IDBVFS_JOURNAL_SEGMENT_SIZE);
+		}
 	}
 
-	int xDeviceCharacteristics() override {
-		return 0;
+	int writeWal(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		if (!storeExtents(p, iAmt, iOfst, IDBVFS_JOURNAL_SEGMENT_SIZE)) {
+			return SQLITE_IOERR_WRITE;
+		}
+		file_size.update_if_greater(iAmt + iOfst);
+		return SQLITE_OK;
 	}
 
-private:
-	int readDb(void *p, int iAmt, sqlite3_int64 iOfst) {
-		int page_number;
-		sqlite3_int64 offset_in_page;
-		if (iOfst + iAmt >= 512) {
-			if (iOfst % iAmt != 0) {
-				return SQLITE_IOERR_READ;
-			}
-			page_number = iOfst / iAmt;
-			offset_in_page = 0;
-		} else {
-			page_number = 0;
-			offset_in_page = iOfst;
-		}
-
-		IdbPage page(file_name, page_number);
-		int loaded_bytes = page.load_into((uint8_t*) p, iAmt, offset_in_page);
-		if (loaded_bytes < iAmt) {
-			return SQLITE_IOERR_SHORT_READ;
-		}
-		else {
-			return SQLITE_OK;
+	void truncateWal(sqlite3_int64 size) {
+		sqlite3_int64 old_size = file_size.get();
+		file_size.set(size);
+		if (size < old_size) {
+			truncateExtents(size, old_size, IDBVFS_JOURNAL_SEGMENT_SIZE);
 		}
 	}
 
-	int readJournal(void *p, int iAmt, sqlite3_int64 iOfst) {
-		if (journal_data.empty()) {
-			size_t journal_size = file_size.get();
-			if (journal_size > 0) {
-				IdbPage page(file_name, 0);
-				page.load_into(journal_data, journal_size);
-			}
+	int readTemp(void *p, int iAmt, sqlite3_int64 iOfst) {
+		int available_bytes = iOfst < (sqlite3_int64) temp_data.size() ? std::min<sqlite3_int64>(iAmt, temp_data.size() - iOfst) : 0;
+		if (available_bytes > 0) {
+			memcpy(p, temp_data.data() + iOfst, available_bytes);
 		}
-		if (iAmt + iOfst > journal_data.size()) {
+		if (available_bytes < iAmt) {
+			memset((uint8_t *) p + available_bytes, 0, iAmt - available_bytes);
 			return SQLITE_IOERR_SHORT_READ;
 		}
-		memcpy(p, journal_data.data() + iOfst, iAmt);
 		return SQLITE_OK;
 	}
 
-	int writeDb(const void *p, int iAmt, sqlite3_int64 iOfst) {
-		int page_number = iOfst ? iOfst / iAmt : 0;
-
-		IdbPage page(file_name, page_number);
-		int stored_bytes = page.store(p, iAmt);
-		if (stored_bytes < iAmt) {
-			return SQLITE_IOERR_WRITE;
+	int writeTemp(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		if (iAmt + iOfst > (sqlite3_int64) temp_data.size()) {
+			temp_data.resize(iAmt + iOfst);
 		}
-
-		file_size.update_if_greater(iAmt + iOfst);
+		memcpy(temp_data.data() + iOfst, p, iAmt);
 		return SQLITE_OK;
 	}
 
 	int writeJournal(const void *p, int iAmt, sqlite3_int64 iOfst) {
-		if (iAmt + iOfst > journal_data.size()) {
+		loadJournal();
+		if (iAmt + iOfst > (sqlite3_int64) journal_data.size()) {
 			journal_data.resize(iAmt + iOfst);
 		}
 		memcpy(journal_data.data() + iOfst, p, iAmt);
+		journal_dirty_ranges.add(iOfst, iAmt);
 		return SQLITE_OK;
 	}
 };
 
 struct IdbVfs : public SQLiteVfsImpl<IdbFile> {
+	IdbBackend *backend;
+	int durability = IDBVFS_DURABILITY;
+
 	int xOpen(sqlite3_filename zName, SQLiteFile<IdbFile> *file, int flags, int *pOutFlags) override {
 		TRACE_LOG("OPEN %s", zName);
-		bool is_db = (flags & SQLITE_OPEN_MAIN_DB) || (flags & SQLITE_OPEN_TEMP_DB);
-		file->implementation = IdbFile(zName, is_db);
+		// temporary files are discarded when closed, so they are kept in memory and never reach the backend
+		bool is_temp = zName == nullptr || (flags & (SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TEMP_JOURNAL | SQLITE_OPEN_SUBJOURNAL | SQLITE_OPEN_TRANSIENT_DB));
+		bool is_db = !is_temp && (flags & SQLITE_OPEN_MAIN_DB);
+		bool is_wal = !is_temp && (flags & SQLITE_OPEN_WAL);
+		// databases opened before the backend loads would miss their persisted contents
+		if (!is_temp && !backend->ready()) {
+			return SQLITE_BUSY;
+		}
+		file->implementation = IdbFile(backend, zName, is_db, is_wal, is_temp, IdbFileOptions::from_uri(zName, is_db, durability));
 		return SQLITE_OK;
 	}
 
 	int xDelete(const char *zName, int syncDir) override {
 		TRACE_LOG("DELETE %s", zName);
-		IdbFileSize file_size(zName, false);
-		if (!file_size.remove()) {
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		if (!backend->ready()) {
+			return SQLITE_BUSY;
+		}
+		if (!backend->remove_database(zName)) {
 			return SQLITE_IOERR_DELETE;
 		}
-
-		for (int i = 0; ; i++) {
-			IdbPage page(zName, i);
-			if (!page.remove()) {
-				break;
-			}
+		if (syncDir && !backend->sync_removal(zName)) {
+			return SQLITE_IOERR_DIR_FSYNC;
+		}
+		backend->known_files.set(zName, false);
+		// deleted databases are reclaimed in bulk by the flusher, amortizing their cost without delaying this deletion
+		if (backend->pending_reclaims() >= IDBVFS_MAX_PENDING_DELETES && idbvfs_pending_reclaims.insert(backend).second) {
+			idbvfs_flusher.schedule(std::chrono::milliseconds(0), reclaim_deleted_databases);
 		}
-		rmdir(zName);
 		return SQLITE_OK;
 	}
 
@@ -411,11 +4480,24 @@ struct IdbVfs : public SQLiteVfsImpl<IdbFile> {
 		switch (flags) {
 			case SQLITE_ACCESS_EXISTS:
 			case SQLITE_ACCESS_READWRITE:
-			case SQLITE_ACCESS_READ:
-				IdbFileSize file_size(zName, false);
-				*pResOut = file_size.exists();
+			case SQLITE_ACCESS_READ: {
+				IdbStorageGuard guard(idbvfs_storage_mutex);
+				if (!backend->ready()) {
+					return SQLITE_BUSY;
+				}
+				bool exists;
+				if (!backend->known_files.lookup(zName, exists)) {
+					// files exist once they store their size or first extent, databases may only have the latter
+					IdbStorage *storage = backend->acquire(zName);
+					exists = IdbFileSize(storage, false).exists() || IdbPage(storage, 0).exists();
+					backend->release(storage);
+					backend->known_files.set(zName, exists);
+					idbvfs_global_stats.existence_checks++;
+				}
+				*pResOut = exists;
 				TRACE_LOG("  > %d", *pResOut);
 				return SQLITE_OK;
+			}
 		}
 		return SQLITE_NOTFOUND;
 	}
@@ -433,37 +4515,257 @@ struct IdbVfs : public SQLiteVfsImpl<IdbFile> {
 #endif
 };
 
-extern "C" {
-	const char *IDBVFS_NAME = "idbvfs";
+static IdbBackend *get_backend(int backend) {
+	switch (backend) {
+		case IDBVFS_BACKEND_DIRECTORY: {
+			static IdbDirectoryBackend directory_backend;
+			INLINE_JS({
+				if (!Module.idbvfsSyncfs) {
+					// Mount IDBFS to the "/idbvfs" directory
+					// which is used as the root path for all files
+					FS.mkdir("/idbvfs");
+					FS.mount(IDBFS, {}, "/idbvfs");
+					FS.syncfs(true, function(e) { if (e) console.error(e); });
 
-	int idbvfs_register(int makeDefault) {
-		static SQLiteVfs<IdbVfs> idbvfs(IDBVFS_NAME);
-		INLINE_JS({
-			if (!Module.idbvfsSyncfs) {
-				// Mount IDBFS to the "/idbvfs" directory
-				// which is used as the root path for all files
-				FS.mkdir("/idbvfs");
-				FS.mount(IDBFS, {}, "/idbvfs");
-				FS.syncfs(true, function(e) { if (e) console.error(e); });
-
-				// Run FS.syncfs in a queue, to avoid concurrent execution errors
-				var syncQueue = 0;
-				function doSync() {
-					FS.syncfs(false, function() {
-						syncQueue--;
-						if (syncQueue > 0) {
+					// Run FS.syncfs in a queue, to avoid concurrent execution errors
+					var syncQueue = 0;
+					function doSync() {
+						FS.syncfs(false, function() {
+							syncQueue--;
+							if (syncQueue > 0) {
+								doSync();
+							}
+						});
+					}
+					Module.idbvfsSyncfs = function() {
+						syncQueue++;
+						if (syncQueue == 1) {
 							doSync();
 						}
+					};
+				}
+			});
+			return &directory_backend;
+		}
+
+		case IDBVFS_BACKEND_MEMORY: {
+			static IdbMemoryBackend memory_backend;
+			return &memory_backend;
+		}
+
+#ifndef __EMSCRIPTEN__
+		case IDBVFS_BACKEND_CONTAINER: {
+			static IdbContainerBackend container_backend;
+			return &container_backend;
+		}
+#endif
+
+		case IDBVFS_BACKEND_KEY_VALUE: {
+#ifdef __EMSCRIPTEN__
+			static IdbIndexedDbStore store;
+			INLINE_JS({
+				if (!Module.idbvfsKv) {
+					var kv = Module.idbvfsKv = {
+						db: null,
+						// whether persisted values were loaded, idbvfs refuses to open databases until then
+						loaded: false,
+						// persisted values not loaded by idbvfs yet
+						data: new Map(),
+						// values put or removed (null) since the last commit
+						pending: new Map(),
+						// key prefixes removed since the last commit
+						pendingPrefixRemovals: [],
+					};
+					kv.commit = function() {
+						if (!kv.db || (kv.pending.size == 0 && kv.pendingPrefixRemovals.length == 0)) {
+							return;
+						}
+						var transaction = kv.db.transaction("objects", "readwrite");
+						var objectStore = transaction.objectStore("objects");
+						kv.pendingPrefixRemovals.forEach(function(prefix) {
+							objectStore.delete(IDBKeyRange.bound(prefix, prefix + "\uffff"));
+						});
+						kv.pendingPrefixRemovals = [];
+						kv.pending.forEach(function(value, key) {
+							if (value) {
+								objectStore.put(value, key);
+							}
+							else {
+								objectStore.delete(key);
+							}
+						});
+						kv.pending.clear();
+						transaction.onerror = function() { console.error(transaction.error); };
+					};
+
+					var resolveReady, rejectReady;
+					Module.idbvfsKvReady = new Promise(function(resolve, reject) {
+						resolveReady = resolve;
+						rejectReady = reject;
 					});
+					var request = indexedDB.open("idbvfs", 1);
+					request.onupgradeneeded = function() {
+						request.result.createObjectStore("objects");
+					};
+					request.onerror = function() {
+						console.error(request.error);
+						rejectReady(request.error);
+					};
+					request.onsuccess = function() {
+						kv.db = request.result;
+						var objectStore = kv.db.transaction("objects", "readonly").objectStore("objects");
+						objectStore.openCursor().onsuccess = function(event) {
+							var cursor = event.target.result;
+							if (cursor) {
+								kv.data.set(cursor.key, new Uint8Array(cursor.value));
+								cursor.continue();
+							}
+							else {
+								kv.loaded = true;
+								kv.commit();
+								resolveReady();
+							}
+						};
+					};
+				}
+			});
+#else
+			static IdbLocalKeyValueStore store;
+#endif
+			static IdbKeyValueBackend key_value_backend(&store);
+			return &key_value_backend;
+		}
+
+		default:
+			return nullptr;
+	}
+}
+
+// VFS structs must outlive their registration, so they are never freed
+static std::unordered_map<std::string, SQLiteVfs<IdbVfs> *>& registered_vfs() {
+	static std::unordered_map<std::string, SQLiteVfs<IdbVfs> *> vfs_by_name;
+	return vfs_by_name;
+}
+
+extern "C" {
+	const char *IDBVFS_NAME = "idbvfs";
+
+	int idbvfs_register(int makeDefault) {
+		return idbvfs_register_backend(IDBVFS_NAME, IDBVFS_BACKEND_DIRECTORY, makeDefault);
+	}
+
+	int idbvfs_reclaim_storage() {
+		std::set<IdbBackend *> backends;
+		for (auto& it : registered_vfs()) {
+			backends.insert(it.second->implementation.backend);
+		}
+		std::vector<std::unique_ptr<IdbReclaimTask>> tasks;
+		{
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			for (IdbBackend *backend : backends) {
+				tasks.push_back(backend->begin_reclaim());
+			}
+		}
+		int removed_objects = 0;
+		for (std::unique_ptr<IdbReclaimTask>& task : tasks) {
+			removed_objects += task->run();
+		}
+		return removed_objects;
+	}
+
+	void idbvfs_get_stats(idbvfs_stats *stats) {
+		stats->kv_objects_put = idbvfs_global_stats.kv_objects_put;
+		stats->kv_objects_removed = idbvfs_global_stats.kv_objects_removed;
+		stats->kv_commits = idbvfs_global_stats.kv_commits;
+		stats->journal_bytes_written = idbvfs_global_stats.journal_bytes_written;
+		stats->pages_fetched = idbvfs_global_stats.pages_fetched;
+		stats->objects_read = idbvfs_global_stats.objects_read;
+		stats->existence_checks = idbvfs_global_stats.existence_checks;
+		stats->objects_written = idbvfs_global_stats.objects_written;
+		stats->memory_used = idbvfs_memory.get_used();
+		stats->pages_evicted = idbvfs_memory.get_evicted_pages();
+		stats->background_flushes = idbvfs_flusher.get_completed();
+	}
+
+	int idbvfs_flush(const char *dbname, int timeout) {
+		if (dbname) {
+			IdbStorageGuard guard(idbvfs_storage_mutex);
+			// storages are named after full paths, with journals and WAL files next to their database
+			for (auto& it : registered_vfs()) {
+				SQLiteVfs<IdbVfs> *vfs = it.second;
+				IdbBackend *backend = vfs->implementation.backend;
+				std::vector<char> path(vfs->mxPathname + 1);
+				if (vfs->xFullPathname(vfs, dbname, path.size(), path.data()) != SQLITE_OK) {
+					continue;
 				}
-				Module.idbvfsSyncfs = function() {
-					syncQueue++;
-					if (syncQueue == 1) {
-						doSync();
+				for (const char *suffix : { "", "-journal", "-wal" }) {
+					IdbStorage *storage = backend->acquire((std::string(path.data()) + suffix).c_str());
+					// syncs left without a barrier by the durability level are made durable as well
+					if (storage->group_commit.pending()) {
+						storage->group_commit.barrier_done();
+						storage->pending_barrier = idbvfs_flusher.enqueue(storage->begin_flush(SQLITE_SYNC_NORMAL));
 					}
-				};
+					backend->release(storage);
+				}
 			}
-		});
-		return idbvfs.register_vfs(makeDefault);
+		}
+		return idbvfs_flusher.wait(idbvfs_flusher.last_started(), timeout);
+	}
+
+	long long idbvfs_memory_limit(long long bytes) {
+		long long previous_limit = idbvfs_memory.get_limit();
+		if (bytes >= 0) {
+			idbvfs_memory.set_limit(bytes);
+			if (bytes > 0 && idbvfs_memory.get_used() > bytes) {
+				IdbSharedPageCache::release_memory(idbvfs_memory.get_used() - bytes);
+			}
+		}
+		return previous_limit;
+	}
+
+	long long idbvfs_release_memory(long long bytes) {
+		return IdbSharedPageCache::release_memory(bytes);
+	}
+
+	int idbvfs_set_durability(const char *vfsName, int level) {
+		if (vfsName == nullptr || level < IDBVFS_DURABILITY_OFF || level > IDBVFS_DURABILITY_FULL) {
+			return SQLITE_MISUSE;
+		}
+		auto it = registered_vfs().find(vfsName);
+		if (it == registered_vfs().end()) {
+			return SQLITE_MISUSE;
+		}
+		it->second->implementation.durability = level;
+		return SQLITE_OK;
+	}
+
+	int idbvfs_ready(const char *vfsName) {
+		if (vfsName == nullptr) {
+			return SQLITE_MISUSE;
+		}
+		auto it = registered_vfs().find(vfsName);
+		if (it == registered_vfs().end()) {
+			return SQLITE_MISUSE;
+		}
+		IdbStorageGuard guard(idbvfs_storage_mutex);
+		return it->second->implementation.backend->ready();
+	}
+
+	int idbvfs_register_backend(const char *vfsName, int backend, int makeDefault) {
+		IdbBackend *idb_backend = get_backend(backend);
+		if (vfsName == nullptr || idb_backend == nullptr) {
+			return SQLITE_MISUSE;
+		}
+
+		auto it = registered_vfs().find(vfsName);
+		if (it == registered_vfs().end()) {
+			it = registered_vfs().emplace(vfsName, nullptr).first;
+			it->second = new SQLiteVfs<IdbVfs>(it->first.c_str());
+			it->second->implementation.backend = idb_backend;
+		}
+		else if (it->second->implementation.backend != idb_backend) {
+			return SQLITE_MISUSE;
+		}
+		return it->second->register_vfs(makeDefault);
 	}
 }
@@ -46,6 +46,176 @@ extern const char *IDBVFS_NAME;
  */
 int idbvfs_register(int makeDefault);
 
+/**
+ * Storage backend that keeps each database as files inside a directory.
+ * On Emscripten, directories live in an IDBFS mount persisted to Indexed DB.
+ * This is the backend used by `idbvfs_register`.
+ */
+#define IDBVFS_BACKEND_DIRECTORY 0
+
+/**
+ * Storage backend that keeps databases in memory for the lifetime of the process.
+ * Useful for measuring idbvfs without any file system costs.
+ */
+#define IDBVFS_BACKEND_MEMORY 1
+
+/**
+ * Storage backend that keeps databases in memory and persists them to a key-value store.
+ * Only objects changed since the last sync are persisted, in a single batch.
+ * On Emscripten, the store is an Indexed DB database named "idbvfs".
+ * On other platforms, the store is an in-process stand-in that lives as long as the process.
+ */
+#define IDBVFS_BACKEND_KEY_VALUE 2
+
+/**
+ * Storage backend that packs each database, and each of its journals, into a single container file
+ * with a small header, read and written in place like the files of SQLite's default VFS.
+ * Only available in native builds, where it avoids the cost of a file per extent.
+ */
+#define IDBVFS_BACKEND_CONTAINER 3
+
+/**
+ * Registers an idbvfs instance that uses a specific storage backend in SQLite 3.
+ *
+ * @param vfsName  Name of the registered VFS.
+ *                 Registering the same name again with the same backend only updates whether it is the default VFS.
+ * @param backend  One of the `IDBVFS_BACKEND_*` constants.
+ * @param makeDefault  Whether this VFS will be the new default VFS.
+ * @return Return value from `sqlite3_vfs_register`, or `SQLITE_MISUSE` if the backend is invalid
+ *         or not available in this build, or `vfsName` is already used by another backend.
+ * @see https://sqlite.org/c3ref/vfs_find.html
+ */
+int idbvfs_register_backend(const char *vfsName, int backend, int makeDefault);
+
+/**
+ * Whether the storage of a registered idbvfs instance can be used.
+ *
+ * On Emscripten, the key-value backend loads the Indexed DB store asynchronously after registration.
+ * Until then, opening, checking or deleting its databases fails with `SQLITE_BUSY`.
+ * Wait for the `Module.idbvfsKvReady` promise, or for this function to return 1, before using them.
+ * Other backends are ready as soon as they are registered.
+ *
+ * @param vfsName  Name of the registered VFS.
+ * @return 1 if ready, 0 if still loading, or `SQLITE_MISUSE` if the VFS is not registered.
+ */
+int idbvfs_ready(const char *vfsName);
+
+/**
+ * Durability level without persistence barriers, like `PRAGMA synchronous=OFF`.
+ * Writes are persisted when the database is closed, or whenever the storage persists them on its own.
+ */
+#define IDBVFS_DURABILITY_OFF 0
+
+/**
+ * Durability level that groups syncs into a persistence barrier, by default at most every second or 100 syncs,
+ * like `PRAGMA synchronous=NORMAL`. Pending syncs are persisted by a background timer once that interval
+ * goes by, and when the database is closed. On storages that persist files one by one, only WAL commits are grouped.
+ */
+#define IDBVFS_DURABILITY_NORMAL 1
+
+/**
+ * Durability level with a persistence barrier for each sync, like `PRAGMA synchronous=FULL`.
+ * This is the default.
+ */
+#define IDBVFS_DURABILITY_FULL 2
+
+/**
+ * Sets the durability level of databases opened with a registered idbvfs instance from now on.
+ * Databases can override it with the "durability" URI parameter.
+ *
+ * @param vfsName  Name of the registered VFS.
+ * @param level  One of the `IDBVFS_DURABILITY_*` constants.
+ * @return `SQLITE_OK`, or `SQLITE_MISUSE` if the VFS is not registered or the level is invalid.
+ */
+int idbvfs_set_durability(const char *vfsName, int level);
+
+/**
+ * Waits until everything committed so far is durable.
+ *
+ * With asynchronous commits, syncs return as soon as data is handed to a background
+ * flusher thread, which completes persistence barriers in order. Syncs left without
+ * a barrier by the durability level of `dbname` get one now as well.
+ *
+ * @param dbname  Name of a database whose pending syncs are made durable, or NULL to
+ *                only wait for the barriers already started.
+ * @param timeout  Maximum number of milliseconds to wait, or a negative value to wait as long as needed.
+ * @return `SQLITE_OK`, `SQLITE_BUSY` if the timeout expired first, or `SQLITE_IOERR_FSYNC`
+ *         if a barrier completed in the background failed since the previous call.
+ */
+int idbvfs_flush(const char *dbname, int timeout);
+
+/**
+ * Reclaims the storage of deleted databases.
+ *
+ * Deleting a database, like SQLite does with journals at the end of transactions,
+ * only detaches its objects from the database name, so that it costs the same
+ * regardless of database size. Their storage is reclaimed in bulk in the background
+ * after a number of deletions, or when this function is called, for example when the
+ * application is idle. The directory backend on Emscripten is the exception: IDBFS would
+ * persist renamed directories again, so deleting removes their objects right away,
+ * in time proportional to their number.
+ *
+ * @return Number of removed objects.
+ */
+int idbvfs_reclaim_storage(void);
+
+/**
+ * Counters of the work done by idbvfs since the process started, and its current memory use.
+ */
+typedef struct idbvfs_stats {
+	/// Number of objects written to the store by the key-value backend.
+	long long kv_objects_put;
+	/// Number of objects removed from the store by the key-value backend.
+	long long kv_objects_removed;
+	/// Number of batches committed to the store by the key-value backend.
+	long long kv_commits;
+	/// Number of journal bytes written to storage.
+	long long journal_bytes_written;
+	/// Number of pages handed to SQLite by xFetch, without copying them.
+	long long pages_fetched;
+	/// Number of object reads from storage.
+	long long objects_read;
+	/// Number of file existence checks answered by the storage backend.
+	long long existence_checks;
+	/// Number of bytes currently held by the caches and buffers of all open files.
+	long long memory_used;
+	/// Number of cached pages evicted to stay within the memory budget or by `idbvfs_release_memory`.
+	long long pages_evicted;
+	/// Number of persistence barriers completed by the background flusher, for asynchronous commits.
+	long long background_flushes;
+	/// Number of object writes to storage, including partial writes.
+	long long objects_written;
+} idbvfs_stats;
+
+/**
+ * Get the current idbvfs counters.
+ */
+void idbvfs_get_stats(idbvfs_stats *stats);
+
+/**
+ * Gets or sets the memory budget shared by the caches and buffers of all open files.
+ *
+ * When idbvfs uses more than this limit, cached pages are evicted and buffered writes
+ * are stored early. When SQLite and idbvfs together use more than the limit set with
+ * `sqlite3_soft_heap_limit64`, page caches shrink gradually instead, keeping at least
+ * `IDBVFS_MEMORY_FLOOR` bytes.
+ *
+ * @param bytes  New limit in bytes, 0 for no limit, or a negative value to leave it unchanged.
+ * @return Limit in effect before the call.
+ * @see https://sqlite.org/c3ref/hard_heap_limit64.html
+ */
+long long idbvfs_memory_limit(long long bytes);
+
+/**
+ * Frees memory held by cached pages, the idbvfs counterpart of `sqlite3_release_memory`.
+ * SQLite does not tell VFSs when memory is released, so call both when memory is low.
+ *
+ * @param bytes  Number of bytes to free.
+ * @return Number of bytes actually freed.
+ * @see https://sqlite.org/c3ref/release_memory.html
+ */
+long long idbvfs_release_memory(long long bytes);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,14 @@
 #include <idbvfs.h>
 #include <sqlite3.h>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include <catch2/catch_test_macros.hpp>
 
@@ -13,3 +22,928 @@ TEST_CASE("SQLite using idbvfs can read and write database", "[idbvfs]") {
 
 	sqlite3_close(db);
 }
+
+TEST_CASE("SQLite using idbvfs can change the database page size", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_page_size.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_page_size.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "PRAGMA page_size = 1024", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) INSERT INTO test_table(value) SELECT randomblob(300) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+
+	REQUIRE(sqlite3_exec(db, "PRAGMA page_size = 8192; VACUUM", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(db);
+
+	REQUIRE(sqlite3_open_v2("test_page_size.sqlite", &db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	sqlite3_stmt *stmt;
+	REQUIRE(sqlite3_prepare_v2(db, "SELECT (SELECT page_size FROM pragma_page_size), (SELECT count(*) FROM test_table), (SELECT integrity_check FROM pragma_integrity_check)", -1, &stmt, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+	REQUIRE(sqlite3_column_int(stmt, 0) == 8192);
+	REQUIRE(sqlite3_column_int(stmt, 1) == 100);
+	REQUIRE(std::string((const char *) sqlite3_column_text(stmt, 2)) == "ok");
+	sqlite3_finalize(stmt);
+
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs memory backend keeps databases in memory", "[idbvfs]") {
+	REQUIRE(idbvfs_register_backend("idbvfs-memory", IDBVFS_BACKEND_MEMORY, false) == SQLITE_OK);
+	REQUIRE(idbvfs_register_backend("idbvfs-memory", IDBVFS_BACKEND_DIRECTORY, false) == SQLITE_MISUSE);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_memory.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "idbvfs-memory") == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(id) VALUES(NULL)", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(db);
+
+	REQUIRE(sqlite3_open_v2("test_memory.sqlite", &db, SQLITE_OPEN_READWRITE, "idbvfs-memory") == SQLITE_OK);
+	sqlite3_stmt *stmt;
+	REQUIRE(sqlite3_prepare_v2(db, "SELECT count(*) FROM test_table", -1, &stmt, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+	REQUIRE(sqlite3_column_int(stmt, 0) == 1);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	REQUIRE(access("test_memory.sqlite", F_OK) != 0);
+}
+
+TEST_CASE("idbvfs key-value backend persists only changed objects", "[idbvfs]") {
+	REQUIRE(idbvfs_register_backend("idbvfs-kv", IDBVFS_BACKEND_KEY_VALUE, false) == SQLITE_OK);
+	// the in-process store needs no initial load
+	REQUIRE(idbvfs_ready("idbvfs-kv") == 1);
+	REQUIRE(idbvfs_ready("idbvfs-unknown") == SQLITE_MISUSE);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_kv.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "idbvfs-kv") == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) INSERT INTO test_table(value) SELECT randomblob(500) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+
+	idbvfs_stats before, after;
+	idbvfs_get_stats(&before);
+	REQUIRE(sqlite3_exec(db, "UPDATE test_table SET value = randomblob(500) WHERE id = 500", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&after);
+	// a few database pages plus journal and size objects, not the whole database
+	REQUIRE(after.kv_objects_put - before.kv_objects_put > 0);
+	REQUIRE(after.kv_objects_put - before.kv_objects_put < 10);
+	sqlite3_close(db);
+
+	REQUIRE(sqlite3_open_v2("test_kv.sqlite", &db, SQLITE_OPEN_READWRITE, "idbvfs-kv") == SQLITE_OK);
+	sqlite3_stmt *stmt;
+	REQUIRE(sqlite3_prepare_v2(db, "SELECT count(*) FROM test_table", -1, &stmt, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+	REQUIRE(sqlite3_column_int(stmt, 0) == 1000);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+}
+
+static int count_stored_objects(const char *dbname) {
+	int count = 0;
+	if (DIR *dir = opendir(dbname)) {
+		while (struct dirent *entry = readdir(dir)) {
+			if (entry->d_name[0] != '.') {
+				count++;
+			}
+		}
+		closedir(dir);
+	}
+	return count;
+}
+
+TEST_CASE("idbvfs reclaims storage when database is truncated", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_truncate.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_truncate.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO test_table(value) SELECT randomblob(4000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	int objects_before = count_stored_objects("test_truncate.sqlite");
+
+	REQUIRE(sqlite3_exec(db, "DELETE FROM test_table WHERE id > 10; VACUUM", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_stmt *stmt;
+	REQUIRE(sqlite3_prepare_v2(db, "PRAGMA page_count", -1, &stmt, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+	int page_count = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	// one object per page, plus the "extent_size" object, the size comes from the database header
+	int objects_after = count_stored_objects("test_truncate.sqlite");
+	REQUIRE(objects_after < objects_before);
+	REQUIRE(objects_after == page_count + 1);
+}
+
+TEST_CASE("idbvfs reclaims storage of deleted databases in bulk", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	idbvfs_reclaim_storage();
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_delete.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS test_table(id INTEGER PRIMARY KEY)", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(db);
+	int stored_objects = count_stored_objects("test_delete.sqlite");
+	REQUIRE(stored_objects > 0);
+
+	REQUIRE(vfs->xDelete(vfs, "test_delete.sqlite", 0) == SQLITE_OK);
+	int exists;
+	REQUIRE(vfs->xAccess(vfs, "test_delete.sqlite", SQLITE_ACCESS_EXISTS, &exists) == SQLITE_OK);
+	REQUIRE(exists == 0);
+	REQUIRE(count_stored_objects("test_delete.sqlite") == 0);
+
+	REQUIRE(idbvfs_reclaim_storage() >= stored_objects);
+	REQUIRE(idbvfs_reclaim_storage() == 0);
+
+	// deleted directories left behind by a previous process are reclaimed as well
+	REQUIRE(mkdir("test_delete.sqlite-deleted-1000", 0755) == 0);
+	FILE *leftover = fopen("test_delete.sqlite-deleted-1000/0", "w");
+	REQUIRE(leftover != NULL);
+	fclose(leftover);
+	REQUIRE(idbvfs_reclaim_storage() == 1);
+	struct stat st;
+	REQUIRE(stat("test_delete.sqlite-deleted-1000", &st) != 0);
+
+	// enough deletions are reclaimed by the flusher thread, without waiting for the deletion that triggered it
+	for (int i = 0; i < 16; i++) {
+		std::string name = "test_delete_" + std::to_string(i) + ".sqlite";
+		REQUIRE(mkdir(name.c_str(), 0755) == 0);
+		FILE *object = fopen((name + "/0").c_str(), "w");
+		REQUIRE(object != NULL);
+		fclose(object);
+		REQUIRE(vfs->xDelete(vfs, name.c_str(), 0) == SQLITE_OK);
+	}
+	bool reclaimed = false;
+	for (int i = 0; i < 500 && !reclaimed; i++) {
+		reclaimed = true;
+		if (DIR *dir = opendir(".")) {
+			while (struct dirent *entry = readdir(dir)) {
+				if (strncmp(entry->d_name, "test_delete_", 12) == 0) {
+					reclaimed = false;
+				}
+			}
+			closedir(dir);
+		}
+		if (!reclaimed) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+	REQUIRE(reclaimed);
+}
+
+TEST_CASE("idbvfs stores only the changed part of rollback journals", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_journal.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_journal.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO test_table(value) SELECT randomblob(3000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+
+	// a small page cache spills several times, syncing the journal each time
+	idbvfs_stats stats_before, stats_after;
+	idbvfs_get_stats(&stats_before);
+	REQUIRE(sqlite3_exec(db, "PRAGMA cache_size = 10; UPDATE test_table SET value = randomblob(3000)", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&stats_after);
+	sqlite3_close(db);
+
+	// every page is journaled once, with its page number and checksum
+	long long journal_bytes = 200 * (4096 + 8);
+	long long journal_bytes_written = stats_after.journal_bytes_written - stats_before.journal_bytes_written;
+	REQUIRE(journal_bytes_written > 0);
+	REQUIRE(journal_bytes_written < 2 * journal_bytes);
+}
+
+static int query_int(sqlite3 *db, const char *sql) {
+	sqlite3_stmt *stmt;
+	int value = -1;
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+		value = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	return value;
+}
+
+TEST_CASE("idbvfs supports WAL mode with readers that don't block the writer", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_wal.sqlite", 0);
+
+	sqlite3 *writer, *reader;
+	REQUIRE(sqlite3_open_v2("test_wal.sqlite", &writer, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	sqlite3_stmt *stmt;
+	REQUIRE(sqlite3_prepare_v2(writer, "PRAGMA journal_mode = WAL", -1, &stmt, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+	REQUIRE(std::string((const char *) sqlite3_column_text(stmt, 0)) == "wal");
+	sqlite3_finalize(stmt);
+	REQUIRE(sqlite3_exec(writer, "CREATE TABLE test_table(id INTEGER PRIMARY KEY); INSERT INTO test_table(id) VALUES(NULL)", NULL, NULL, NULL) == SQLITE_OK);
+
+	REQUIRE(sqlite3_open_v2("test_wal.sqlite", &reader, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(reader, "BEGIN", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(reader, "SELECT count(*) FROM test_table") == 1);
+
+	// the writer commits while the reader keeps its snapshot
+	REQUIRE(sqlite3_exec(writer, "INSERT INTO test_table(id) VALUES(NULL)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(reader, "SELECT count(*) FROM test_table") == 1);
+	REQUIRE(sqlite3_exec(reader, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(reader, "SELECT count(*) FROM test_table") == 2);
+
+	sqlite3_close(reader);
+	sqlite3_close(writer);
+
+	REQUIRE(sqlite3_open_v2("test_wal.sqlite", &reader, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(query_int(reader, "SELECT count(*) FROM test_table") == 2);
+	sqlite3_close(reader);
+}
+
+TEST_CASE("idbvfs syncs the files of native directories as a batch", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_sync.sqlite", 0);
+
+	// more files are written than the pool keeps open, with their barrier left to idbvfs_flush
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("file:test_sync.sqlite?durability=0&pages_per_extent=1", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "PRAGMA page_size = 1024; CREATE TABLE test_table(value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) INSERT INTO test_table SELECT randomblob(900) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+
+	// files removed before the barrier have nothing left to sync
+	REQUIRE(unlink("test_sync.sqlite/1") == 0);
+	REQUIRE(idbvfs_flush("test_sync.sqlite", -1) == SQLITE_OK);
+	sqlite3_close(db);
+
+	// deletions SQLite asks to sync make the directory holding the database durable
+	REQUIRE(vfs->xDelete(vfs, "test_sync.sqlite", 1) == SQLITE_OK);
+	int exists = 1;
+	REQUIRE(vfs->xAccess(vfs, "test_sync.sqlite", SQLITE_ACCESS_EXISTS, &exists) == SQLITE_OK);
+	REQUIRE(exists == 0);
+	struct stat file_stat;
+	REQUIRE(stat("test_sync.sqlite", &file_stat) != 0);
+}
+
+TEST_CASE("idbvfs keeps the WAL size of all connections when one of them closes", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_wal_size.sqlite", 0);
+	vfs->xDelete(vfs, "test_wal_size.sqlite-wal", 0);
+
+	// the process exits without closing the last connection, so the WAL is read back from storage
+	pid_t pid = fork();
+	if (pid == 0) {
+		sqlite3 *first, *second;
+		bool success = sqlite3_open_v2("test_wal_size.sqlite", &first, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK
+			&& sqlite3_exec(first, "PRAGMA journal_mode = WAL; CREATE TABLE test_table(value); INSERT INTO test_table VALUES (1)", NULL, NULL, NULL) == SQLITE_OK
+			&& sqlite3_open_v2("test_wal_size.sqlite", &second, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK
+			&& sqlite3_exec(second, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 2000) INSERT INTO test_table SELECT randomblob(100) FROM n", NULL, NULL, NULL) == SQLITE_OK
+			&& sqlite3_close(first) == SQLITE_OK;
+		_exit(success ? 0 : 1);
+	}
+	int status;
+	REQUIRE(waitpid(pid, &status, 0) == pid);
+	REQUIRE(WIFEXITED(status));
+	REQUIRE(WEXITSTATUS(status) == 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_wal_size.sqlite", &db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 2001);
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs shares mapped pages with SQLite when mmap_size is set", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_mmap.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_mmap.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "PRAGMA mmap_size = 1048576", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) INSERT INTO test_table(value) SELECT randomblob(1000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+
+	idbvfs_stats stats_before, stats_after;
+	idbvfs_get_stats(&stats_before);
+	REQUIRE(query_int(db, "SELECT sum(length(value)) FROM test_table") == 100 * 1000);
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(stats_after.pages_fetched > stats_before.pages_fetched);
+
+	// mapped pages reflect writes made after they were fetched
+	REQUIRE(sqlite3_exec(db, "UPDATE test_table SET value = zeroblob(10) WHERE id <= 50", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT sum(length(value)) FROM test_table") == 50 * 10 + 50 * 1000);
+	REQUIRE(query_int(db, "SELECT count(*) FROM pragma_integrity_check WHERE integrity_check = 'ok'") == 1);
+	sqlite3_close(db);
+
+	// mapped pages are drawn from the memory budget, SQLite reads pages with xRead when it is exceeded
+	long long previous_limit = idbvfs_memory_limit(1);
+	REQUIRE(sqlite3_open_v2("test_mmap.sqlite", &db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "PRAGMA mmap_size = 1048576", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&stats_before);
+	REQUIRE(query_int(db, "SELECT sum(length(value)) FROM test_table") == 50 * 10 + 50 * 1000);
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(stats_after.pages_fetched == stats_before.pages_fetched);
+	sqlite3_close(db);
+	idbvfs_memory_limit(previous_limit);
+}
+
+TEST_CASE("idbvfs publishes batch atomic writes only when committed", "[idbvfs]") {
+	REQUIRE(idbvfs_register_backend("idbvfs-memory", IDBVFS_BACKEND_MEMORY, false) == SQLITE_OK);
+	sqlite3_vfs *vfs = sqlite3_vfs_find("idbvfs-memory");
+
+	std::vector<char> file_buffer(vfs->szOsFile);
+	sqlite3_file *file = (sqlite3_file *) file_buffer.data();
+	REQUIRE(vfs->xOpen(vfs, "test_atomic.sqlite", file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_DB, NULL) == SQLITE_OK);
+	REQUIRE((file->pMethods->xDeviceCharacteristics(file) & SQLITE_IOCAP_BATCH_ATOMIC) != 0);
+
+	std::string page(4096, 'a'), read_page(4096, '\0');
+	REQUIRE(file->pMethods->xWrite(file, page.data(), page.size(), 0) == SQLITE_OK);
+
+	// rolled back writes are discarded
+	std::string new_page(4096, 'b');
+	REQUIRE(file->pMethods->xFileControl(file, SQLITE_FCNTL_BEGIN_ATOMIC_WRITE, NULL) == SQLITE_OK);
+	REQUIRE(file->pMethods->xWrite(file, new_page.data(), new_page.size(), 0) == SQLITE_OK);
+	REQUIRE(file->pMethods->xWrite(file, new_page.data(), new_page.size(), 4096) == SQLITE_OK);
+	REQUIRE(file->pMethods->xFileControl(file, SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE, NULL) == SQLITE_OK);
+	sqlite3_int64 file_size;
+	REQUIRE(file->pMethods->xFileSize(file, &file_size) == SQLITE_OK);
+	REQUIRE(file_size == 4096);
+	REQUIRE(file->pMethods->xRead(file, &read_page[0], read_page.size(), 0) == SQLITE_OK);
+	REQUIRE(read_page == page);
+
+	// committed writes are all published
+	REQUIRE(file->pMethods->xFileControl(file, SQLITE_FCNTL_BEGIN_ATOMIC_WRITE, NULL) == SQLITE_OK);
+	REQUIRE(file->pMethods->xWrite(file, new_page.data(), new_page.size(), 0) == SQLITE_OK);
+	REQUIRE(file->pMethods->xWrite(file, new_page.data(), new_page.size(), 4096) == SQLITE_OK);
+	REQUIRE(file->pMethods->xFileControl(file, SQLITE_FCNTL_COMMIT_ATOMIC_WRITE, NULL) == SQLITE_OK);
+	REQUIRE(file->pMethods->xFileSize(file, &file_size) == SQLITE_OK);
+	REQUIRE(file_size == 8192);
+	REQUIRE(file->pMethods->xRead(file, &read_page[0], read_page.size(), 4096) == SQLITE_OK);
+	REQUIRE(read_page == new_page);
+
+	file->pMethods->xClose(file);
+	vfs->xDelete(vfs, "test_atomic.sqlite", 0);
+}
+
+static int count_directory_entries(const char *path) {
+	int count = 0;
+	if (DIR *dir = opendir(path)) {
+		while (readdir(dir)) {
+			count++;
+		}
+		closedir(dir);
+	}
+	return count;
+}
+
+TEST_CASE("idbvfs keeps temporary files in memory", "[idbvfs]") {
+	idbvfs_register(false);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_temp.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS test_table(id INTEGER PRIMARY KEY)", NULL, NULL, NULL) == SQLITE_OK);
+	int entries_before = count_directory_entries(".");
+
+	// a small temp cache makes the temp database spill to a file
+	REQUIRE(sqlite3_exec(db, "PRAGMA temp_store = FILE; PRAGMA temp.cache_size = 10", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TEMP TABLE temp_table AS WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) SELECT i, randomblob(500) AS value FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM (SELECT * FROM temp_table ORDER BY value)") == 1000);
+	REQUIRE(count_directory_entries(".") == entries_before);
+
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs keeps caches coherent across connections", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_coherence.sqlite", 0);
+
+	sqlite3 *db, *other_db;
+	REQUIRE(sqlite3_open_v2("test_coherence.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 40) INSERT INTO test_table(value) SELECT randomblob(1000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 40);
+
+	// short read transactions on a warm database are served from memory
+	idbvfs_stats stats_before, stats_after;
+	idbvfs_get_stats(&stats_before);
+	for (int i = 1; i <= 40; i++) {
+		REQUIRE(query_int(db, ("SELECT length(value) FROM test_table WHERE id = " + std::to_string(i)).c_str()) == 1000);
+	}
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(stats_after.objects_read == stats_before.objects_read);
+
+	// changes made by other connections are seen, reloading only what changed
+	REQUIRE(sqlite3_open_v2("test_coherence.sqlite", &other_db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(other_db, "INSERT INTO test_table(value) VALUES(randomblob(1000))", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(other_db);
+	idbvfs_get_stats(&stats_before);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 41);
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(stats_after.objects_read - stats_before.objects_read < 10);
+
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs answers repeated hot journal probes from memory", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_access.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_access.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY); INSERT INTO test_table(id) VALUES(NULL)", NULL, NULL, NULL) == SQLITE_OK);
+
+	idbvfs_stats stats_before, stats_after;
+	idbvfs_get_stats(&stats_before);
+	for (int i = 0; i < 20; i++) {
+		REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 1);
+	}
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(stats_after.existence_checks == stats_before.existence_checks);
+
+	// SQLite uses full path names
+	std::string db_filename = sqlite3_db_filename(db, "main");
+	int exists;
+	REQUIRE(vfs->xAccess(vfs, db_filename.c_str(), SQLITE_ACCESS_EXISTS, &exists) == SQLITE_OK);
+	REQUIRE(exists == 1);
+	REQUIRE(vfs->xAccess(vfs, (db_filename + "-journal").c_str(), SQLITE_ACCESS_EXISTS, &exists) == SQLITE_OK);
+	REQUIRE(exists == 0);
+	sqlite3_close(db);
+
+	// only the most recently probed files are remembered
+	idbvfs_get_stats(&stats_before);
+	for (int i = 0; i < 2000; i++) {
+		vfs->xAccess(vfs, ("test_access_probe_" + std::to_string(i)).c_str(), SQLITE_ACCESS_EXISTS, &exists);
+	}
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(stats_after.existence_checks - stats_before.existence_checks == 2000);
+	REQUIRE(vfs->xAccess(vfs, "test_access_probe_1999", SQLITE_ACCESS_EXISTS, &exists) == SQLITE_OK);
+	idbvfs_get_stats(&stats_before);
+	REQUIRE(stats_before.existence_checks == stats_after.existence_checks);
+	REQUIRE(vfs->xAccess(vfs, "test_access_probe_0", SQLITE_ACCESS_EXISTS, &exists) == SQLITE_OK);
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(stats_after.existence_checks == stats_before.existence_checks + 1);
+}
+
+TEST_CASE("idbvfs locks databases shared by connections on different threads", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_locking.sqlite", 0);
+
+	sqlite3 *db, *writer_db, *probe_db;
+	REQUIRE(sqlite3_open_v2("test_locking.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY)", NULL, NULL, NULL) == SQLITE_OK);
+	const int lock_timeout = 5000;
+	REQUIRE(sqlite3_open_v2(("file:test_locking.sqlite?lock_timeout=" + std::to_string(lock_timeout)).c_str(), &writer_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_open_v2("test_locking.sqlite", &probe_db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+
+	// only one connection may write at a time
+	REQUIRE(sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(writer_db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_BUSY);
+	REQUIRE(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+
+	// a writer waiting for a reader resumes as soon as the reader is done
+	REQUIRE(sqlite3_exec(db, "BEGIN; SELECT count(*) FROM test_table", NULL, NULL, NULL) == SQLITE_OK);
+	int writer_result = -1;
+	std::thread writer([&]() {
+		writer_result = sqlite3_exec(writer_db, "INSERT INTO test_table(id) VALUES(NULL)", NULL, NULL, NULL);
+	});
+	// once the writer holds its reserved lock, it can only commit after the reader
+	for (int i = 0; i < 1000 && sqlite3_exec(probe_db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK; i++) {
+		REQUIRE(sqlite3_exec(probe_db, "ROLLBACK", NULL, NULL, NULL) == SQLITE_OK);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	REQUIRE(sqlite3_exec(probe_db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_BUSY);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 0);
+	REQUIRE(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+	writer.join();
+	REQUIRE(writer_result == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 1);
+
+	// in WAL mode, a connection closing while others read does not wait for them
+	REQUIRE(sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(writer_db, "SELECT count(*) FROM test_table") == 1);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 1);
+	// a close that waited for the lock would take the whole lock timeout
+	auto close_start = std::chrono::steady_clock::now();
+	sqlite3_close(writer_db);
+	REQUIRE(std::chrono::steady_clock::now() - close_start < std::chrono::milliseconds(lock_timeout));
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 1);
+	sqlite3_close(probe_db);
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs shares the page cache between connections", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_shared_cache.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_shared_cache.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 40) INSERT INTO test_table(value) SELECT randomblob(1000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT sum(length(value)) FROM test_table") == 40000);
+
+	// pages loaded by one connection are served from memory to the others
+	idbvfs_stats stats_before, stats_after;
+	idbvfs_get_stats(&stats_before);
+	std::vector<std::thread> readers;
+	std::vector<int> results(4);
+	for (int i = 0; i < 4; i++) {
+		readers.emplace_back([&results, i]() {
+			sqlite3 *reader_db;
+			if (sqlite3_open_v2("test_shared_cache.sqlite", &reader_db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK) {
+				results[i] = query_int(reader_db, "SELECT sum(length(value)) FROM test_table");
+			}
+			sqlite3_close(reader_db);
+		});
+	}
+	for (std::thread& reader : readers) {
+		reader.join();
+	}
+	idbvfs_get_stats(&stats_after);
+	REQUIRE(results == std::vector<int>(4, 40000));
+	REQUIRE(stats_after.objects_read == stats_before.objects_read);
+
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs fills the default page cache before evicting", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_cache_capacity.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_cache_capacity.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 56) INSERT INTO test_table(value) SELECT randomblob(3000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "PRAGMA page_count") <= 64);
+
+	// a database smaller than the cache is read from memory once loaded, whichever pages it is made of
+	idbvfs_stats stats_before, stats_after;
+	for (int i = 0; i < 2; i++) {
+		idbvfs_get_stats(&stats_before);
+		sqlite3 *reader_db;
+		REQUIRE(sqlite3_open_v2("test_cache_capacity.sqlite", &reader_db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+		REQUIRE(query_int(reader_db, "SELECT sum(length(value)) FROM test_table") == 56 * 3000);
+		sqlite3_close(reader_db);
+		idbvfs_get_stats(&stats_after);
+	}
+	REQUIRE(stats_after.objects_read == stats_before.objects_read);
+	REQUIRE(stats_after.pages_evicted == stats_before.pages_evicted);
+
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs keeps caches and buffers within the memory budget", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_memory_budget.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("file:test_memory_budget.sqlite?page_cache_size=1000&write_buffer_size=1000", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO test_table(value) SELECT randomblob(2000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT sum(length(value)) FROM test_table") == 400000);
+
+	idbvfs_stats stats;
+	idbvfs_get_stats(&stats);
+	REQUIRE(stats.memory_used > 400000);
+
+	// lowering the limit evicts cached pages right away
+	long long previous_limit = idbvfs_memory_limit(100000);
+	idbvfs_get_stats(&stats);
+	REQUIRE(stats.memory_used <= 100000);
+	long long evicted_before = stats.pages_evicted;
+	REQUIRE(evicted_before > 0);
+
+	// later reads and writes stay within the limit
+	REQUIRE(sqlite3_exec(db, "UPDATE test_table SET value = randomblob(2000)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT sum(length(value)) FROM test_table") == 400000);
+	idbvfs_get_stats(&stats);
+	REQUIRE(stats.memory_used <= 100000 + 65536);
+	REQUIRE(stats.pages_evicted > evicted_before);
+
+	REQUIRE(idbvfs_memory_limit(previous_limit) == 100000);
+	REQUIRE(idbvfs_release_memory(1 << 30) > 0);
+	idbvfs_get_stats(&stats);
+	REQUIRE(stats.memory_used < 100000);
+
+	// memory used by SQLite shrinks the caches down to a floor, without emptying them
+	sqlite3_int64 previous_soft_heap_limit = sqlite3_soft_heap_limit64(1);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 1000) INSERT INTO test_table(value) SELECT randomblob(2000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT sum(length(value)) FROM test_table") == 2400000);
+	idbvfs_get_stats(&stats);
+	REQUIRE(stats.memory_used > 500000);
+	REQUIRE(stats.memory_used < 2000000);
+	sqlite3_soft_heap_limit64(previous_soft_heap_limit);
+
+	sqlite3_close(db);
+}
+
+static long long count_kv_commits(const char *uri, int inserts) {
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2(uri, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, "idbvfs-kv") == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_stats before, after;
+	idbvfs_get_stats(&before);
+	for (int i = 0; i < inserts; i++) {
+		REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(value) VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+	}
+	idbvfs_get_stats(&after);
+	sqlite3_close(db);
+	return after.kv_commits - before.kv_commits;
+}
+
+TEST_CASE("idbvfs groups persistence barriers according to the durability level", "[idbvfs]") {
+	REQUIRE(idbvfs_register_backend("idbvfs-kv", IDBVFS_BACKEND_KEY_VALUE, false) == SQLITE_OK);
+	REQUIRE(idbvfs_set_durability("idbvfs-unknown", IDBVFS_DURABILITY_OFF) == SQLITE_MISUSE);
+	REQUIRE(idbvfs_set_durability("idbvfs-kv", 3) == SQLITE_MISUSE);
+
+	// FULL persists each transaction
+	REQUIRE(count_kv_commits("file:test_durability.sqlite?durability=2", 20) >= 20);
+	// NORMAL persists at most every IDBVFS_GROUP_COMMIT_SIZE syncs or IDBVFS_GROUP_COMMIT_INTERVAL milliseconds
+	REQUIRE(count_kv_commits("file:test_durability.sqlite?durability=1", 20) < 5);
+	// OFF only persists when closing
+	REQUIRE(count_kv_commits("file:test_durability.sqlite?durability=0", 20) == 0);
+
+	// the VFS setting applies to databases without the URI parameter
+	idbvfs_stats before, after;
+	idbvfs_get_stats(&before);
+	REQUIRE(idbvfs_set_durability("idbvfs-kv", IDBVFS_DURABILITY_OFF) == SQLITE_OK);
+	REQUIRE(count_kv_commits("test_durability.sqlite", 20) == 0);
+	REQUIRE(idbvfs_set_durability("idbvfs-kv", IDBVFS_DURABILITY_FULL) == SQLITE_OK);
+	idbvfs_get_stats(&after);
+	// syncs without a barrier are persisted when the database is closed
+	REQUIRE(after.kv_commits - before.kv_commits == 1);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_durability.sqlite", &db, SQLITE_OPEN_READWRITE, "idbvfs-kv") == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 80);
+	sqlite3_close(db);
+
+	// leave the flusher thread idle, waiting for barriers
+	REQUIRE(sqlite3_open_v2("file:test_durability.sqlite?durability=0", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, "idbvfs-kv") == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(value) VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(idbvfs_flush("test_durability.sqlite", -1) == SQLITE_OK);
+	sqlite3_close(db);
+
+	// with NORMAL, grouped syncs are persisted once their interval goes by, even without later syncs
+	REQUIRE(sqlite3_open_v2("file:test_durability.sqlite?durability=1&group_commit_interval=200", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, "idbvfs-kv") == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(value) VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&before);
+	REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(value) VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+	for (int i = 0; i < 1000; i++) {
+		idbvfs_get_stats(&after);
+		if (after.kv_commits > before.kv_commits) {
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(after.kv_commits > before.kv_commits);
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs completes asynchronous commits in the background", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_async.sqlite", 0);
+
+	idbvfs_stats before, after;
+	idbvfs_get_stats(&before);
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("file:test_async.sqlite?async_commit=1", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	for (int i = 0; i < 20; i++) {
+		REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(value) VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+	}
+	// native directories persist files one by one, so rollback journal barriers order SQLite's writes and can't wait
+	idbvfs_get_stats(&after);
+	REQUIRE(after.background_flushes == before.background_flushes);
+
+	// WAL commits leave their barrier to the background flusher
+	REQUIRE(sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&before);
+	for (int i = 0; i < 20; i++) {
+		REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(value) VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+	}
+	// committed data is read back while barriers are still running
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 40);
+
+	REQUIRE(idbvfs_flush("test_async.sqlite", -1) == SQLITE_OK);
+	idbvfs_get_stats(&after);
+	REQUIRE(after.background_flushes - before.background_flushes >= 20);
+
+	// checkpoints copy frames into the database once their barriers are complete
+	REQUIRE(sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL) == SQLITE_OK);
+	sqlite3_close(db);
+	REQUIRE(sqlite3_open_v2("test_async.sqlite", &db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 40);
+	sqlite3_close(db);
+
+	REQUIRE(idbvfs_flush(NULL, 0) == SQLITE_OK);
+}
+
+TEST_CASE("idbvfs makes a single persistence barrier per commit", "[idbvfs]") {
+	REQUIRE(idbvfs_register_backend("idbvfs-kv", IDBVFS_BACKEND_KEY_VALUE, false) == SQLITE_OK);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("file:test_barrier.sqlite?vfs=idbvfs-kv", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "ATTACH 'file:test_barrier_1.sqlite?vfs=idbvfs-kv' AS aux1", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "ATTACH 'file:test_barrier_2.sqlite?vfs=idbvfs-kv' AS aux2", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS main.t(value); CREATE TABLE IF NOT EXISTS aux1.t(value); CREATE TABLE IF NOT EXISTS aux2.t(value)", NULL, NULL, NULL) == SQLITE_OK);
+
+	idbvfs_stats before, after;
+	idbvfs_get_stats(&before);
+	REQUIRE(sqlite3_exec(db, "INSERT INTO main.t VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&after);
+	// the journal and the database share the barrier at the end of the commit
+	REQUIRE(after.kv_commits - before.kv_commits == 1);
+
+	idbvfs_get_stats(&before);
+	REQUIRE(sqlite3_exec(db, "BEGIN; INSERT INTO main.t VALUES (1); INSERT INTO aux1.t VALUES (1); INSERT INTO aux2.t VALUES (1); COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&after);
+	// the super-journal is persisted before the journals that list it, then these and the databases share a barrier
+	REQUIRE(after.kv_commits - before.kv_commits == 2);
+	sqlite3_close(db);
+}
+
+TEST_CASE("idbvfs does not defer commit barriers to other write transactions", "[idbvfs]") {
+	REQUIRE(idbvfs_register_backend("idbvfs-kv", IDBVFS_BACKEND_KEY_VALUE, false) == SQLITE_OK);
+
+	sqlite3 *writer, *db;
+	REQUIRE(sqlite3_open_v2("file:test_barrier_writer.sqlite?vfs=idbvfs-kv", &writer, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_open_v2("file:test_barrier_other.sqlite?vfs=idbvfs-kv", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(writer, "CREATE TABLE IF NOT EXISTS t(value)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS t(value)", NULL, NULL, NULL) == SQLITE_OK);
+
+	// a write transaction spilling its journal stays open on another database
+	REQUIRE(sqlite3_exec(writer, "PRAGMA cache_size = 2; BEGIN IMMEDIATE; INSERT INTO t SELECT randomblob(2000) FROM (SELECT 1 UNION ALL SELECT 2 UNION ALL SELECT 3 UNION ALL SELECT 4)", NULL, NULL, NULL) == SQLITE_OK);
+
+	idbvfs_stats before, after;
+	for (int i = 0; i < 5; i++) {
+		idbvfs_get_stats(&before);
+		REQUIRE(sqlite3_exec(db, "INSERT INTO t VALUES (randomblob(100))", NULL, NULL, NULL) == SQLITE_OK);
+		idbvfs_get_stats(&after);
+		// each commit is durable when it returns
+		REQUIRE(after.kv_commits - before.kv_commits == 1);
+	}
+
+	idbvfs_get_stats(&before);
+	REQUIRE(sqlite3_exec(writer, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+	idbvfs_get_stats(&after);
+	REQUIRE(after.kv_commits - before.kv_commits == 1);
+	sqlite3_close(db);
+	sqlite3_close(writer);
+}
+
+TEST_CASE("idbvfs container backend packs databases into a single file", "[idbvfs]") {
+	REQUIRE(idbvfs_register_backend("idbvfs-container", IDBVFS_BACKEND_CONTAINER, false) == SQLITE_OK);
+	sqlite3_vfs *vfs = sqlite3_vfs_find("idbvfs-container");
+	vfs->xDelete(vfs, "test_container.sqlite", 0);
+
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("test_container.sqlite", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "idbvfs-container") == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "PRAGMA page_size=4096; CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100) INSERT INTO test_table(value) SELECT randomblob(1000) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	int page_count = query_int(db, "PRAGMA page_count");
+	sqlite3_close(db);
+
+	// the database pages follow the container header, and the journal is gone with the transaction
+	struct stat file_stat;
+	REQUIRE(stat("test_container.sqlite", &file_stat) == 0);
+	REQUIRE(S_ISREG(file_stat.st_mode));
+	REQUIRE(file_stat.st_size == 4096 + page_count * 4096);
+	REQUIRE(stat("test_container.sqlite-journal", &file_stat) != 0);
+
+	REQUIRE(sqlite3_open_v2("test_container.sqlite", &db, SQLITE_OPEN_READWRITE, "idbvfs-container") == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table") == 100);
+	sqlite3_close(db);
+
+	REQUIRE(vfs->xDelete(vfs, "test_container.sqlite", 0) == SQLITE_OK);
+	REQUIRE(stat("test_container.sqlite", &file_stat) != 0);
+}
+
+TEST_CASE("idbvfs reads and writes across extent boundaries", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_extents.sqlite", 0);
+	vfs->xDelete(vfs, "test_extents_raw.sqlite", 0);
+
+	// a database with 4 pages per extent keeps its layout when reopened without the parameter
+	sqlite3 *db;
+	REQUIRE(sqlite3_open_v2("file:test_extents.sqlite?pages_per_extent=4", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "PRAGMA page_size = 1024; CREATE TABLE test_table(id INTEGER PRIMARY KEY, value BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 200) INSERT INTO test_table(value) SELECT randomblob(900) FROM n", NULL, NULL, NULL) == SQLITE_OK);
+	int page_count = query_int(db, "PRAGMA page_count");
+	sqlite3_close(db);
+	// one object per 4 pages, plus the size of extents
+	REQUIRE(count_stored_objects("test_extents.sqlite") == (page_count + 3) / 4 + 1);
+
+	REQUIRE(sqlite3_open_v2("test_extents.sqlite", &db, SQLITE_OPEN_READWRITE, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db, "UPDATE test_table SET value = randomblob(900) WHERE id % 7 = 0", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(query_int(db, "SELECT count(*) FROM test_table WHERE length(value) = 900") == 200);
+	REQUIRE(query_int(db, "SELECT integrity_check = 'ok' FROM pragma_integrity_check") == 1);
+	sqlite3_close(db);
+
+	// writes at any offset span as many extents as needed
+	const char *params[] = { "pages_per_extent", "4" };
+	sqlite3_filename file_name = sqlite3_create_filename("test_extents_raw.sqlite", "", "", 1, params);
+	std::vector<uint8_t> data(5000);
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = i % 251;
+	}
+	for (int reopen = 0; reopen < 2; reopen++) {
+		std::vector<uint8_t> file_memory(vfs->szOsFile);
+		sqlite3_file *file = (sqlite3_file *) file_memory.data();
+		int out_flags;
+		REQUIRE(vfs->xOpen(vfs, file_name, file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_DB, &out_flags) == SQLITE_OK);
+		if (reopen == 0) {
+			// the first write defines extents of 4 times its size
+			std::vector<uint8_t> first_page(1024, 1);
+			REQUIRE(file->pMethods->xWrite(file, first_page.data(), first_page.size(), 0) == SQLITE_OK);
+			REQUIRE(file->pMethods->xWrite(file, data.data(), data.size(), 3000) == SQLITE_OK);
+			REQUIRE(file->pMethods->xSync(file, SQLITE_SYNC_NORMAL) == SQLITE_OK);
+		}
+		std::vector<uint8_t> read_back(data.size());
+		REQUIRE(file->pMethods->xRead(file, read_back.data(), read_back.size(), 3000) == SQLITE_OK);
+		REQUIRE(read_back == data);
+		sqlite3_int64 size;
+		REQUIRE(file->pMethods->xFileSize(file, &size) == SQLITE_OK);
+		REQUIRE(size == 8000);
+		file->pMethods->xClose(file);
+	}
+	sqlite3_free_filename(file_name);
+	// extents 0 and 1, plus the size of extents and the file size
+	REQUIRE(count_stored_objects("test_extents_raw.sqlite") == 4);
+}
+
+static long long count_objects_written() {
+	idbvfs_stats stats;
+	idbvfs_get_stats(&stats);
+	return stats.objects_written;
+}
+
+TEST_CASE("idbvfs stores buffered page writes once per sync", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_write_buffer.sqlite", 0);
+
+	std::vector<uint8_t> page(4096, 7);
+	long long objects_written[2];
+	for (int buffered = 0; buffered < 2; buffered++) {
+		const char *params[] = { "write_buffer_size", buffered ? "100" : "0" };
+		sqlite3_filename file_name = sqlite3_create_filename("test_write_buffer.sqlite", "", "", 1, params);
+		std::vector<uint8_t> file_memory(vfs->szOsFile);
+		sqlite3_file *file = (sqlite3_file *) file_memory.data();
+		int out_flags;
+		REQUIRE(vfs->xOpen(vfs, file_name, file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_DB, &out_flags) == SQLITE_OK);
+		REQUIRE(file->pMethods->xWrite(file, page.data(), page.size(), 4096) == SQLITE_OK);
+		REQUIRE(file->pMethods->xSync(file, SQLITE_SYNC_NORMAL) == SQLITE_OK);
+
+		long long before = count_objects_written();
+		for (int i = 0; i < 10; i++) {
+			page[0] = i;
+			REQUIRE(file->pMethods->xWrite(file, page.data(), page.size(), 4096) == SQLITE_OK);
+		}
+		REQUIRE(file->pMethods->xSync(file, SQLITE_SYNC_NORMAL) == SQLITE_OK);
+		objects_written[buffered] = count_objects_written() - before;
+
+		std::vector<uint8_t> read_back(page.size());
+		REQUIRE(file->pMethods->xRead(file, read_back.data(), read_back.size(), 4096) == SQLITE_OK);
+		REQUIRE(read_back == page);
+		file->pMethods->xClose(file);
+		sqlite3_free_filename(file_name);
+	}
+	// the page itself, and the file size
+	REQUIRE(objects_written[1] <= 2);
+	REQUIRE(objects_written[0] >= 10);
+}
+
+TEST_CASE("idbvfs write buffers are stored when write transactions end", "[idbvfs]") {
+	idbvfs_register(false);
+	sqlite3_vfs *vfs = sqlite3_vfs_find(IDBVFS_NAME);
+	vfs->xDelete(vfs, "test_write_buffer_shared.sqlite", 0);
+
+	// without syncs, buffered pages must still reach storage before other connections read them
+	const char *uri = "file:test_write_buffer_shared.sqlite?write_buffer_size=100&page_cache_size=0";
+	sqlite3 *db1, *db2;
+	REQUIRE(sqlite3_open_v2(uri, &db1, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_open_v2(uri, &db2, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, IDBVFS_NAME) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db1, "PRAGMA synchronous = OFF", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db2, "PRAGMA synchronous = OFF", NULL, NULL, NULL) == SQLITE_OK);
+	REQUIRE(sqlite3_exec(db1, "CREATE TABLE test_table(id INTEGER PRIMARY KEY, value TEXT)", NULL, NULL, NULL) == SQLITE_OK);
+
+	for (int i = 0; i < 20; i++) {
+		sqlite3 *db = i % 2 ? db2 : db1;
+		REQUIRE(sqlite3_exec(db, "INSERT INTO test_table(value) SELECT printf('%.*c', 500, 'x') FROM (SELECT 1 UNION ALL SELECT 2)", NULL, NULL, NULL) == SQLITE_OK);
+		REQUIRE(query_int(db1, "SELECT count(*) FROM test_table") == (i + 1) * 2);
+		REQUIRE(query_int(db2, "SELECT count(*) FROM test_table") == (i + 1) * 2);
+	}
+	REQUIRE(query_int(db1, "SELECT integrity_check = 'ok' FROM pragma_integrity_check") == 1);
+	REQUIRE(query_int(db2, "SELECT integrity_check = 'ok' FROM pragma_integrity_check") == 1);
+	sqlite3_close(db1);
+	sqlite3_close(db2);
+}